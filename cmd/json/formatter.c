@@ -1,11 +1,16 @@
 // link ebnf/ebnf.o ebnf/analysis.o scanner/scanner.o
 // link regex.o arena.o collections.o logging.o
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "ebnf/ebnf.h"
 #include "logging.h"
 #include "macros.h"
+#include "regex.h"
 #include "text.h"
 
 #define tok(key, pattern) [key] = {#key, (char *)pattern}
@@ -47,6 +52,8 @@ const rule_def rules[] = {
 
 static bool pretty = true;
 static bool recursive = false;
+// File the compiled regexes are kept in between runs, or NULL
+static const char *regex_image = NULL;
 
 void visit(AST *a, int indent) {
 #define print(a) printf("%.*s", a->range.n, a->range.str)
@@ -117,6 +124,34 @@ void format(FILE *f) {
   vec_destroy(&buf);
 }
 
+// Load the regexes saved in path into the regex cache. Returns false if there is no valid image there.
+static bool load_regexes(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  void *data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return false;
+  if (regex_load_cache(data, st.st_size) < 0) {
+    munmap(data, st.st_size);
+    return false;
+  }
+  // The regexes are used in place, so the image stays mapped until the process exits
+  return true;
+}
+
+static void save_regexes(const char *path) {
+  FILE *f = fopen(path, "wb");
+  if (!f || !regex_save_cache(f))
+    warn("Failed to save regexes to %s:", path);
+  if (f)
+    fclose(f);
+}
+
 int main(int argc, char **argv) {
   set_loglevel(LL_INFO);
   FILE *f = stdin;
@@ -128,6 +163,8 @@ int main(int argc, char **argv) {
       recursive = strcmp(recstr, "true") == 0;
       i++;
     }
+    else if (strcmp(argv[i], "--regex-image") == 0 && i + 1 < argc)
+      regex_image = argv[++i];
     else {
       f = fopen(argv[i], "r");
       if (!f)
@@ -135,7 +172,11 @@ int main(int argc, char **argv) {
       break;
     }
   }
+  // Compiling the regexes of the grammar is skipped when an image of them was saved by an earlier run
+  bool loaded = regex_image && load_regexes(regex_image);
   format(f);
   fclose(f);
+  if (regex_image && !loaded)
+    save_regexes(regex_image);
   return 0;
 }
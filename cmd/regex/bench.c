@@ -0,0 +1,287 @@
+// link: regex.o arena.o collections.o logging.o
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "logging.h"
+#include "macros.h"
+#include "regex.h"
+
+/* Measure the regex engine against the POSIX regcomp and regexec of the C library.
+ * usage: bench [-j] [-t seconds] [name...]
+ *
+ * Every case is a pattern and a corpus of lines generated from a fixed seed, so runs on the same machine are
+ * comparable. For each case it reports:
+ *  - compile: microseconds for mk_regex, with the cache cleared every time, and for regcomp
+ *  - matches: MB/s of regex_matches at the beginning of every line, and of regexec with the pattern anchored
+ *  - find: MB/s of finding every match in every line with regex_find, and with regexec, and the number of matches
+ *    each found. The counts can differ where leftmost-first and leftmost-longest matches do.
+ *  - strict: MB/s of matches() on every line, which includes looking up the compiled pattern in the cache, and of
+ *    regexec with the pattern anchored at both ends
+ * Each measurement is repeated for at least the given time, 0.2 seconds by default. Only the named cases are run
+ * if any are given. With -j the regexes are compiled to native code with regex_jit before matching, so comparing
+ * runs with and without it compares the JIT with the interpreter.
+ */
+
+// Lines of the generated text corpora
+#define TEXT_LINES 40000
+// Length of the single line of the long corpus
+#define LONG_SIZE (16 << 20)
+// Length of the lines of the pathological corpora
+#define NESTED_SIZE 4096
+
+typedef enum { CORPUS_TEXT, CORPUS_LOWER, CORPUS_AB, CORPUS_A, CORPUS_LONG, NCORPORA } corpus_kind;
+
+// Lines separated by NUL bytes, so each one is a string of its own
+typedef struct {
+  char *data;
+  long size;
+  int nlines;
+} corpus;
+
+typedef struct {
+  const char *name;
+  const char *pattern;
+  corpus_kind corpus;
+} benchmark;
+
+static const benchmark benchmarks[] = {
+    {"literal",     "Sherlock Holmes",                CORPUS_TEXT },
+    {"literal-alt", "Sherlock|Holmes|Watson|Adler",   CORPUS_TEXT },
+    {"suffix",      "[a-z]+ing",                      CORPUS_TEXT },
+    {"date",        "[0-9]{4}-[0-9]{2}-[0-9]{2}",     CORPUS_TEXT },
+    {"words",       "(the|of|and|a|to|in)( [a-z]+)+", CORPUS_TEXT },
+    {"email",       "[a-z0-9.]+@[a-z0-9]+\\.[a-z]+",  CORPUS_TEXT },
+    {"lowercase",   "[a-z ]*",                        CORPUS_LOWER},
+    {"nested",      "(a*)*b",                         CORPUS_A    },
+    {"nested-alt",  "(a|aa)*c",                       CORPUS_A    },
+    {"counted",     "(a|b)*a(a|b){12}",               CORPUS_AB   },
+    {"long",        "x[0-9]{4}y",                     CORPUS_LONG },
+};
+
+static const char *words[] = {
+    "the",    "of",      "and",     "a",       "to",      "in",     "was",    "he",     "that",   "it",
+    "his",    "her",     "you",     "had",     "with",    "for",    "said",   "upon",   "there",  "which",
+    "morning", "evening", "looking", "nothing", "something", "window", "street", "letter", "Baker", "Street",
+    "Holmes", "Watson",  "Lestrade", "Hudson", "Adler",   "London", "inspector", "returning", "remarkable",
+};
+
+static unsigned seed;
+static unsigned next_random(void) {
+  seed = seed * 1103515245 + 12345;
+  return seed >> 16;
+}
+
+static corpus make_corpus(corpus_kind kind) {
+  seed = kind + 1;
+  vec v = v_make(char);
+  char buf[64];
+  switch (kind) {
+  case CORPUS_TEXT:
+  case CORPUS_LOWER:
+    for (int line = 0; line < TEXT_LINES; line++) {
+      int nwords = 4 + next_random() % 12;
+      for (int w = 0; w < nwords; w++) {
+        unsigned r = next_random() % 100;
+        int n;
+        if (kind == CORPUS_TEXT && r == 0)
+          n = snprintf(buf, sizeof(buf), "%04u-%02u-%02u", 1880 + next_random() % 40, 1 + next_random() % 12,
+                       1 + next_random() % 28);
+        else if (kind == CORPUS_TEXT && r == 1)
+          n = snprintf(buf, sizeof(buf), "%s.%s@%s.org", words[next_random() % LENGTH(words)],
+                       words[next_random() % LENGTH(words)], words[next_random() % 20]);
+        else {
+          const char *word = words[next_random() % LENGTH(words)];
+          n = snprintf(buf, sizeof(buf), "%s", word);
+          if (kind == CORPUS_LOWER)
+            buf[0] |= 0x20;
+        }
+        vec_push_array(&v, n, buf);
+        if (w + 1 < nwords)
+          vec_push(&v, " ");
+      }
+      vec_push(&v, "");
+    }
+    break;
+  case CORPUS_AB:
+  case CORPUS_A:
+    for (int line = 0; line < 16; line++) {
+      for (int i = 0; i < NESTED_SIZE; i++)
+        vec_push(&v, kind == CORPUS_A || next_random() % 2 ? "a" : "b");
+      vec_push(&v, "");
+    }
+    break;
+  case CORPUS_LONG:
+    for (long i = 0; i < LONG_SIZE; i++) {
+      char c = next_random() % 16 ? 'a' + next_random() % 26 : '0' + next_random() % 10;
+      vec_push(&v, &c);
+    }
+    vec_push(&v, "");
+    break;
+  default:
+    break;
+  }
+  corpus c = {.data = v.array, .size = v.n};
+  for (long i = 0; i < c.size; i++)
+    c.nlines += c.data[i] == '\0';
+  return c;
+}
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// What a measurement runs, once per repetition
+typedef enum {
+  RUN_COMPILE,
+  RUN_MATCHES,
+  RUN_FIND,
+  RUN_STRICT,
+} run_kind;
+
+typedef struct {
+  const benchmark *b;
+  const corpus *c;
+  regex *r;
+  regex_t anchored;
+  regex_t strict;
+  regex_t unanchored;
+  // Matches found by the last repetition
+  long count;
+} context;
+
+static void run_ours(context *ctx, run_kind kind) {
+  ctx->count = 0;
+  if (kind == RUN_COMPILE) {
+    regex *r = mk_regex(ctx->b->pattern);
+    destroy_regex(r);
+    regex_cache_clear();
+    return;
+  }
+  for (const char *line = ctx->c->data, *end = line + ctx->c->size; line < end; line += strlen(line) + 1) {
+    if (kind == RUN_MATCHES) {
+      match_context m = mk_ctx(line);
+      ctx->count += regex_matches(ctx->r, &m).match;
+    } else if (kind == RUN_STRICT) {
+      ctx->count += matches(ctx->b->pattern, line);
+    } else {
+      regex_match m;
+      for (const char *s = line; *s && (m = regex_find(ctx->r, s)).match; ctx->count++)
+        s = m.matched.str + (m.matched.n ? m.matched.n : 1);
+    }
+  }
+}
+
+static void run_libc(context *ctx, run_kind kind) {
+  ctx->count = 0;
+  if (kind == RUN_COMPILE) {
+    regex_t r;
+    if (regcomp(&r, ctx->b->pattern, REG_EXTENDED) == 0)
+      regfree(&r);
+    return;
+  }
+  regmatch_t m;
+  for (const char *line = ctx->c->data, *end = line + ctx->c->size; line < end; line += strlen(line) + 1) {
+    if (kind == RUN_MATCHES) {
+      ctx->count += regexec(&ctx->anchored, line, 1, &m, 0) == 0;
+    } else if (kind == RUN_STRICT) {
+      ctx->count += regexec(&ctx->strict, line, 0, NULL, REG_NOSUB) == 0;
+    } else {
+      for (const char *s = line; *s && regexec(&ctx->unanchored, s, 1, &m, s == line ? 0 : REG_NOTBOL) == 0;
+           ctx->count++)
+        s += m.rm_eo > m.rm_so ? m.rm_eo : m.rm_so + 1;
+    }
+  }
+}
+
+// Repeat a run until it took at least min_time seconds, and return the seconds one repetition took
+static double measure(context *ctx, run_kind kind, bool libc, double min_time) {
+  double start = now(), elapsed = 0;
+  long reps = 0;
+  do {
+    if (libc)
+      run_libc(ctx, kind);
+    else
+      run_ours(ctx, kind);
+    reps++;
+    elapsed = now() - start;
+  } while (elapsed < min_time);
+  return elapsed / reps;
+}
+
+static void compile_posix(regex_t *r, const char *format, const char *pattern, int flags) {
+  char buf[256];
+  snprintf(buf, sizeof(buf), format, pattern);
+  if (regcomp(r, buf, REG_EXTENDED | flags) != 0)
+    die("regcomp failed to compile %s", buf);
+}
+
+int main(int argc, char **argv) {
+  set_loglevel(LL_INFO);
+  double min_time = 0.2;
+  bool jit = false;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+      min_time = atof(argv[++i]);
+    else if (strcmp(argv[i], "-j") == 0)
+      jit = true;
+    else
+      die("usage: %s [-j] [-t seconds] [name...]", argv[0]);
+  }
+
+  corpus corpora[NCORPORA] = {0};
+  printf("%-12s %19s %19s %29s %19s\n", "", "compile (us)", "matches (MB/s)", "find (MB/s, matches)",
+         "strict (MB/s)");
+  printf("%-12s %9s %9s %9s %9s %9s %9s %9s %9s %9s\n", "case", "regex", "libc", "regex", "libc", "regex", "libc",
+         "count", "regex", "libc");
+  for (int b = 0; b < LENGTH(benchmarks); b++) {
+    const benchmark *bench = &benchmarks[b];
+    bool selected = i == argc;
+    for (int j = i; j < argc; j++)
+      selected |= strcmp(argv[j], bench->name) == 0;
+    if (!selected)
+      continue;
+    if (!corpora[bench->corpus].data)
+      corpora[bench->corpus] = make_corpus(bench->corpus);
+    context ctx = {.b = bench, .c = &corpora[bench->corpus], .r = mk_regex(bench->pattern)};
+    if (!ctx.r)
+      die("Invalid pattern %s", bench->pattern);
+    compile_posix(&ctx.anchored, "^(%s)", bench->pattern, 0);
+    compile_posix(&ctx.strict, "^(%s)$", bench->pattern, REG_NOSUB);
+    compile_posix(&ctx.unanchored, "%s", bench->pattern, 0);
+
+    double mb = ctx.c->size / 1e6;
+    // Drop the pattern from the cache, so every repetition compiles it
+    regex_cache_clear();
+    double compile = measure(&ctx, RUN_COMPILE, false, min_time);
+    double compile_libc = measure(&ctx, RUN_COMPILE, true, min_time);
+    if (jit && !regex_jit(ctx.r))
+      warn("%s is matched by the interpreter", bench->name);
+    double match = mb / measure(&ctx, RUN_MATCHES, false, min_time);
+    double match_libc = mb / measure(&ctx, RUN_MATCHES, true, min_time);
+    double find = mb / measure(&ctx, RUN_FIND, false, min_time);
+    long count = ctx.count;
+    double find_libc = mb / measure(&ctx, RUN_FIND, true, min_time);
+    long count_libc = ctx.count;
+    double strict = mb / measure(&ctx, RUN_STRICT, false, min_time);
+    double strict_libc = mb / measure(&ctx, RUN_STRICT, true, min_time);
+    printf("%-12s %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9ld %9.1f %9.1f\n", bench->name, compile * 1e6,
+           compile_libc * 1e6, match, match_libc, find, find_libc, count, strict, strict_libc);
+    if (count != count_libc)
+      printf("%-12s %69s %9ld\n", "", "libc found", count_libc);
+    fflush(stdout);
+
+    regfree(&ctx.anchored);
+    regfree(&ctx.strict);
+    regfree(&ctx.unanchored);
+    destroy_regex(ctx.r);
+  }
+  for (int c = 0; c < NCORPORA; c++)
+    free(corpora[c].data);
+  return 0;
+}
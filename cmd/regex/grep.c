@@ -0,0 +1,263 @@
+// link: regex.o arena.o collections.o logging.o
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "regex.h"
+
+/* Print the lines of files that contain a match of a regex.
+ * usage: grep [-c] [-n] [-s] [-b steps] [-j threads] pattern file...
+ *
+ * Files are memory mapped and split into chunks that end at line boundaries, which the threads of
+ * regex_search_chunks search in parallel. Matching lines are printed in the order of the input, prefixed by the
+ * file name if there are several files, and by the line number with -n. With -c only the number of matching lines of each file is
+ * printed. The exit status is 0 if a line matched, and 1 otherwise.
+ * With -s the work done by the regex is printed to stderr at the end. With -b a search that takes more than `steps`
+ * steps is given up, and the rest of its chunk is skipped with a warning.
+ */
+
+// Bytes of input searched by a thread at a time. Chunks are extended to the end of their last line.
+#define CHUNK_SIZE (1 << 20)
+
+typedef struct {
+  const char *name;
+  const char *data;
+  long size;
+} input;
+
+typedef struct {
+  int file;
+  long start;
+  long end;
+  // Offsets of the matching lines, without their newline
+  vec lines;
+  // Number of lines in the chunk, if line numbers are printed
+  long nlines;
+  // Where the search was given up because it exceeded its budget, or -1
+  long aborted;
+} chunk;
+
+typedef struct {
+  long start;
+  long end;
+  // Line number relative to the beginning of the chunk
+  long number;
+} line;
+
+typedef struct {
+  regex *r;
+  // Set if the regex matches the empty string, and so every line
+  bool nullable;
+  // Set if a match can contain a newline. Then a search over many lines could run far past the line it starts
+  // on, so every line is searched on its own instead.
+  bool multiline;
+  bool count_lines;
+  input *inputs;
+  int ninputs;
+  chunk *chunks;
+  // What is printed: only the number of matching lines of every file, and line numbers
+  bool count;
+  bool numbers;
+  // The file being printed, its matching lines so far and the number of its first line not printed yet
+  int file;
+  long file_count;
+  long line_base;
+  long found;
+} search;
+
+// Count the newlines in the n bytes of s
+static long count_lines(const char *s, long n) {
+  long count = 0;
+  for (const char *end = s + n; (s = memchr(s, '\n', end - s)); s++)
+    count++;
+  return count;
+}
+
+// Find the matching lines of c. Unless matches can span lines, the search runs over the whole chunk and skips the
+// lines between matches at once.
+static void search_chunk(void *arg, int i, regex_scratch *scratch) {
+  search *s = arg;
+  chunk *c = &s->chunks[i];
+  const char *data = s->inputs[c->file].data;
+  long pos = c->start;
+  long number = 0;
+  while (pos < c->end) {
+    const char *newline = memchr(data + pos, '\n', c->end - pos);
+    long end = newline ? newline - data : c->end;
+    long start = pos;
+    if (!s->nullable) {
+      long limit = s->multiline ? end : c->end;
+      regex_match m = regex_find_slice_r(s->r, (string_slice){.n = limit - pos, .str = data + pos}, scratch);
+      if (m.aborted) {
+        c->aborted = pos;
+        break;
+      }
+      if (!m.match && limit == c->end)
+        break;
+      start = m.match ? m.matched.str - data : -1;
+    }
+    if (start > end) {
+      // Back up to the beginning of the line the match starts on
+      long begin = start;
+      while (data[begin - 1] != '\n')
+        begin--;
+      if (s->count_lines)
+        number += count_lines(data + pos, begin - pos);
+      pos = begin;
+      newline = memchr(data + pos, '\n', c->end - pos);
+      end = newline ? newline - data : c->end;
+    }
+    if (start >= 0)
+      vec_push(&c->lines, &(line){.start = pos, .end = end, .number = number});
+    pos = end + 1;
+    number++;
+  }
+  if (s->count_lines)
+    c->nlines = count_lines(data + c->start, c->end - c->start);
+}
+
+// Print the number of matching lines of the file being printed with -c, and move on to the next file
+static void end_file(search *s) {
+  if (s->count) {
+    if (s->ninputs > 1)
+      printf("%s:", s->inputs[s->file].name);
+    printf("%ld\n", s->file_count);
+  }
+  s->found += s->file_count;
+  s->file++;
+  s->file_count = 0;
+  s->line_base = 1;
+}
+
+// Print the matching lines of a chunk, which all chunks before it were printed before
+static bool print_chunk(void *data, int i) {
+  search *s = data;
+  chunk *ch = &s->chunks[i];
+  while (s->file < ch->file)
+    end_file(s);
+  input *in = &s->inputs[ch->file];
+  s->file_count += ch->lines.n;
+  for (int j = 0; j < ch->lines.n && !s->count; j++) {
+    line *l = vec_nth(ch->lines, j);
+    if (s->ninputs > 1)
+      printf("%s:", in->name);
+    if (s->numbers)
+      printf("%ld:", s->line_base + l->number);
+    fwrite(in->data + l->start, 1, l->end - l->start, stdout);
+    putchar('\n');
+  }
+  if (ch->aborted >= 0)
+    warn("Gave up searching %s from offset %d to %d", in->name, (int)ch->aborted, (int)ch->end);
+  s->line_base += ch->nlines;
+  vec_destroy(&ch->lines);
+  return true;
+}
+
+static input map_file(const char *name) {
+  int fd = open(name, O_RDONLY);
+  if (fd < 0)
+    die("Error opening file %s:", name);
+  struct stat st;
+  if (fstat(fd, &st) < 0)
+    die("Error reading file %s:", name);
+  input in = {.name = name, .size = st.st_size};
+  if (in.size > 0) {
+    in.data = mmap(NULL, in.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (in.data == MAP_FAILED)
+      die("Error mapping file %s:", name);
+    madvise((void *)in.data, in.size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+  return in;
+}
+
+// Split every file into chunks that end after a newline or at the end of the file
+static vec split_chunks(input *inputs, int ninputs) {
+  vec chunks = v_make(chunk);
+  for (int f = 0; f < ninputs; f++) {
+    const char *data = inputs[f].data;
+    long size = inputs[f].size;
+    for (long start = 0; start < size;) {
+      long end = start + CHUNK_SIZE < size ? start + CHUNK_SIZE : size;
+      const char *newline = end < size ? memchr(data + end - 1, '\n', size - end + 1) : NULL;
+      end = newline ? newline - data + 1 : size;
+      vec_push(&chunks, &(chunk){.file = f, .start = start, .end = end, .lines = v_make(line), .aborted = -1});
+      start = end;
+    }
+  }
+  return chunks;
+}
+
+int main(int argc, char **argv) {
+  set_loglevel(LL_INFO);
+  bool count = false, numbers = false, stats = false;
+  long budget = 0;
+  int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "-c") == 0)
+      count = true;
+    else if (strcmp(argv[i], "-n") == 0)
+      numbers = true;
+    else if (strcmp(argv[i], "-s") == 0)
+      stats = true;
+    else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+      budget = atol(argv[++i]);
+    else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+      nthreads = atoi(argv[++i]);
+    else
+      die("Unknown option %s", argv[i]);
+  }
+  if (i + 1 >= argc)
+    die("usage: %s [-c] [-n] [-s] [-b steps] [-j threads] pattern file...", argv[0]);
+  if (nthreads < 1)
+    nthreads = 1;
+
+  regex *r = mk_regex(argv[i]);
+  if (!r)
+    die("Invalid pattern %s", argv[i]);
+  if (stats)
+    regex_count_stats(r);
+  int ninputs = argc - i - 1;
+  input *inputs = ecalloc(ninputs, sizeof(input));
+  for (int f = 0; f < ninputs; f++)
+    inputs[f] = map_file(argv[i + 1 + f]);
+
+  vec chunks = split_chunks(inputs, ninputs);
+  match_context empty = mk_ctx("");
+  search s = {
+      .r = r,
+      .nullable = regex_matches(r, &empty).match,
+      .multiline = regex_accepts(r, '\n'),
+      .count_lines = numbers && !count,
+      .inputs = inputs,
+      .ninputs = ninputs,
+      .chunks = chunks.array,
+      .count = count,
+      .numbers = numbers,
+      .line_base = 1,
+  };
+  // Every chunk is printed as soon as it and all chunks before it are done
+  regex_search_chunks(chunks.n, nthreads, budget, search_chunk, print_chunk, &s);
+  // Files after the last chunk, which are empty, still get their count
+  while (s.file < ninputs)
+    end_file(&s);
+
+  if (stats) {
+    regex_stats totals = regex_total_stats(r);
+    regex_print_stats(&totals, stderr);
+  }
+  for (int f = 0; f < ninputs; f++) {
+    if (inputs[f].size > 0)
+      munmap((void *)inputs[f].data, inputs[f].size);
+  }
+  vec_destroy(&chunks);
+  free(inputs);
+  destroy_regex(r);
+  return s.found ? 0 : 1;
+}
@@ -1,9 +1,11 @@
 // link: regex.o arena.o collections.o logging.o
 #include <stdio.h>
 
+#include "logging.h"
 #include "regex.h"
 
 int main(int argc, char *argv[argc + 1]) {
+  set_loglevel(LL_INFO);
   for (int i = 1; (i + 1) < argc; i += 2) {
     char *pattern = argv[i];
     char *test = argv[i + 1];
@@ -0,0 +1,156 @@
+// link: regex.o arena.o collections.o logging.o
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+#include "regex.h"
+
+/* Generate C matchers for regexes ahead of time.
+ * usage: regex2c [-h] name pattern [name pattern ...]
+ *
+ * For every pattern, a function `long name(const char *s, long n)` is written to stdout. It returns the length
+ * of the match at the beginning of s like regex_matches, or -1 if there is none. With -h only the declarations
+ * are written, for use in a header.
+ * The output only depends on the C standard library, so it can be added to src/ and linked with `// link`.
+ */
+
+// Automata with more states than this are rejected instead of generating huge functions
+#define MAX_STATES 4096
+
+static bool valid_name(const char *name) {
+  if (!isalpha((unsigned char)*name) && *name != '_')
+    return false;
+  for (; *name; name++) {
+    if (!isalnum((unsigned char)*name) && *name != '_')
+      return false;
+  }
+  return true;
+}
+
+static void declare(const char *name, const char *pattern) {
+  printf("// Match /");
+  for (const char *c = pattern; *c; c++) {
+    // Keep the pattern on the comment line
+    if (*c == '\n')
+      printf("\\n");
+    else
+      putchar(*c);
+  }
+  printf("/ at the beginning of s. Returns the length of the match, or -1 if there is none.\n");
+  printf("long %s(const char *s, long n)", name);
+}
+
+// Jump to state `to`, or return directly if nothing can change after reaching it
+static void transition(regex_table *t, int to) {
+  if (t->done[to])
+    printf("return %s;\n", t->match[to] ? "i" : "last");
+  else
+    printf("goto s%d;\n", to);
+}
+
+static void generate(const char *name, const char *pattern, regex_table *t) {
+  int nclasses = t->classes.n;
+  // States that are jumped to, and need a label
+  bool *target = ecalloc(t->nstates, sizeof(bool));
+  for (int s = 0; s < t->nstates; s++) {
+    for (int c = 0; c < nclasses && !t->done[s]; c++)
+      target[t->next[s * nclasses + c]] |= !t->done[t->next[s * nclasses + c]];
+  }
+
+  if (t->done[0]) {
+    // The result doesn't depend on the input
+    declare(name, pattern);
+    printf(" {\n  (void)s;\n  (void)n;\n  return %d;\n}\n\n", t->match[0] ? 0 : -1);
+    free(target);
+    return;
+  }
+
+  printf("static const unsigned char %s_classes[256] = {", name);
+  for (int b = 0; b <= UINT8_MAX; b++)
+    printf("%s%d,", b % 16 ? " " : "\n    ", t->classes.map[b]);
+  printf("\n};\n\n");
+
+  declare(name, pattern);
+  printf(" {\n");
+  printf("  const unsigned char *p = (const unsigned char *)s;\n");
+  printf("  long i = 0;\n");
+  printf("  long last = -1;\n");
+  for (int s = 0; s < t->nstates; s++) {
+    if (s > 0 && !target[s])
+      continue;
+    if (target[s])
+      printf("s%d:\n", s);
+    if (t->match[s])
+      printf("  last = i;\n");
+    if (t->done[s]) {
+      printf("  return last;\n");
+      continue;
+    }
+    printf("  if (i == n)\n    return last;\n");
+    printf("  switch (%s_classes[p[i++]]) {\n", name);
+    // Classes leading to the same state share a case
+    bool *emitted = ecalloc(nclasses, sizeof(bool));
+    for (int c = 0; c < nclasses; c++) {
+      if (emitted[c])
+        continue;
+      int to = t->next[s * nclasses + c];
+      for (int o = c; o < nclasses; o++) {
+        if (!emitted[o] && t->next[s * nclasses + o] == to) {
+          emitted[o] = true;
+          printf("    case %d:\n", o);
+        }
+      }
+      printf("      ");
+      transition(t, to);
+    }
+    free(emitted);
+    printf("  }\n");
+    printf("  return last;\n");
+  }
+  printf("}\n\n");
+  free(target);
+}
+
+int main(int argc, char *argv[argc + 1]) {
+  set_loglevel(LL_INFO);
+  bool header = argc > 1 && strcmp(argv[1], "-h") == 0;
+  int first = header ? 2 : 1;
+  if (argc <= first || (argc - first) % 2) {
+    fprintf(stderr, "usage: %s [-h] name pattern [name pattern ...]\n", argv[0]);
+    return 1;
+  }
+  for (int i = first; i < argc; i += 2) {
+    if (!valid_name(argv[i])) {
+      fprintf(stderr, "Invalid function name: %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  printf("// Generated by regex2c. Do not edit.\n\n");
+  for (int i = first; i < argc; i += 2) {
+    const char *name = argv[i];
+    const char *pattern = argv[i + 1];
+    if (header) {
+      declare(name, pattern);
+      printf(";\n");
+      continue;
+    }
+    regex *r = mk_regex(pattern);
+    if (r == NULL) {
+      fprintf(stderr, "Invalid pattern: %s\n", pattern);
+      return 1;
+    }
+    regex_table *t = mk_regex_table(r, MAX_STATES);
+    if (t == NULL) {
+      fprintf(stderr, "Pattern %s needs more than %d states\n", pattern, MAX_STATES);
+      destroy_regex(r);
+      return 1;
+    }
+    generate(name, pattern, t);
+    destroy_regex_table(t);
+    destroy_regex(r);
+  }
+  return 0;
+}
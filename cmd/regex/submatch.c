@@ -1,9 +1,12 @@
 // link: regex.o arena.o collections.o logging.o
 #include <stdio.h>
+#include <stdlib.h>
 
+#include "logging.h"
 #include "regex.h"
 
 int main(int argc, char *argv[argc + 1]) {
+  set_loglevel(LL_INFO);
   for (int i = 1; (i + 1) < argc; i += 2) {
     char *pattern = argv[i];
     char *test = argv[i + 1];
@@ -12,12 +15,21 @@ int main(int argc, char *argv[argc + 1]) {
       printf("Invalid pattern: %s\n", pattern);
       continue;
     }
-    regex_match m = regex_find(r, test);
+    string_slice *groups = ecalloc(r->ngroups + 1, sizeof(string_slice));
+    regex_match m = regex_find_captures(r, test, groups);
     if (m.match) {
-      printf("%.*s\n", m.matched.n, m.matched.str);
+      // The whole match, then every capture group on its own line
+      for (int g = 0; g <= r->ngroups; g++) {
+        if (groups[g].str)
+          printf("%.*s\n", groups[g].n, groups[g].str);
+        else
+          printf("\n");
+      }
     } else {
       fprintf(stderr, "No match.\n");
     }
+    free(groups);
+    destroy_regex(r);
   }
   return 0;
 }
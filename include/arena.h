@@ -9,13 +9,13 @@ typedef struct arena {
   size_t cursor;       // Index to unallocated data.
   struct arena *next;  // Next element in a linked list.
   struct arena *tail;  // Tail of a linked list.
-  char buffer[];       // Start of allocated data.
+  _Alignas(max_align_t) char buffer[];  // Start of allocated data.
 } arena;
 
 // Create a new arena
 arena *mk_arena(void);
 // Free all memory associated with an arena
 void destroy_arena(arena *a);
-// Allocate nmemb * size bytes of memory
+// Allocate nmemb * size bytes of memory, aligned for any type
 void *arena_alloc(arena *a, size_t nmemb, size_t size);
 #endif  // __ARENA_H
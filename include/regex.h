@@ -5,55 +5,274 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#include "arena.h"
 #include "collections.h"
 #include "text.h"
 
-typedef struct nfa nfa;
+typedef struct dfa dfa;
+typedef struct regex_totals regex_totals;
+typedef struct jit_code jit_code;
 typedef unsigned char u8;
 
+// A state of a compiled regex
 typedef struct {
-  size_t n;
-  size_t cap;
-  nfa **arr;
-} nfalist;
+  // Whether the state consumes a character, only follows its transitions, or is the end of the automaton
+  u8 kind;
+  union {
+    // Characters accepted by a consuming state, inclusive
+    struct {
+      u8 lo;
+      u8 hi;
+    };
+    // The capture slot a save state records the position in
+    uint16_t slot;
+  };
+  // The transitions of state i are edges[states[i].out] up to edges[states[i + 1].out], in order of priority
+  uint32_t out;
+} regex_state;
 
-struct nfa {
-  // Possible transitions from this state
-  nfalist lst;
-  // Character accepted by this state
-  u8 accept;
-  // If set and greater than accept, all characters in the range [accept-accept_end] (inclusive) are accepted
-  u8 accept_end;
-  // The end state of this nfa
-  // If NULL, the state itself is considered the end state
-  nfa *end;
-  // The progress the last time this state was visited.
-  // This is used to detect loops when traversing the automaton
-  ssize_t progress;
-};
+// Bytes that no state of a set of regexes tells apart share a class, so transition tables can have a column per
+// class instead of one per byte. Classes are contiguous ranges of bytes, numbered in increasing order.
+typedef struct {
+  // Class of every byte
+  u8 map[UINT8_MAX + 1];
+  // Number of classes
+  int n;
+} byte_classes;
 
 typedef struct {
   bool match;
   string_slice matched;
+  // Set if the match was given up because it exceeded the budget of its scratch
+  bool aborted;
 } regex_match;
 
+// The deterministic automaton regex_matches uses, with every state and transition computed ahead of time.
+// A match is the input up to the last state with `match` set, stopping early at a state with `done` set.
+typedef struct {
+  // State 0 is the start state
+  int nstates;
+  byte_classes classes;
+  // next[state * classes.n + class] is the state reached by consuming a byte of the class
+  int *next;
+  bool *match;
+  bool *done;
+} regex_table;
+
 typedef parse_context match_context;
 #define mk_ctx(string) \
   (parse_context) { .view = (string_slice){ .str = string, .n = strlen(string) } }
 
-typedef struct {
+typedef struct regex {
+  // All memory owned by the regex, including the regex itself
+  arena *a;
+  // Regexes compiled from the same text are shared, and destroy_regex only frees them once every user is done
+  _Atomic int refs;
+  // The text the regex was compiled from. For sets, every pattern prefixed by its length.
+  string_slice source;
   parse_context ctx;
-  nfa *start;
+  // The automaton, laid out contiguously with the start state at index 0.
+  // states[nstates] only marks the end of the transitions of the last state.
+  regex_state *states;
+  uint32_t *edges;
+  int nstates;
+  // Number of capture groups, numbered from 1 in the order of their opening parenthesis
+  int ngroups;
+  // For sets, the pattern every state belongs to. NULL otherwise.
+  int *pattern;
+  byte_classes classes;
+  // Lazily constructed deterministic automata for leftmost-first matches, full matches, searches and sets
+  _Atomic(dfa *) dfa[4];
+  // Used by regex_find to skip input that can't contain a match.
+  // Every match starts with `prefix` and contains `required`. Either may be empty.
+  string_slice prefix;
+  string_slice required;
+  // Characters a match can start with. All are set if the regex matches the empty string.
+  bool first[UINT8_MAX + 1];
+  // Regexes that only match one of a few literals, or a single byte set in `first`, are matched without the
+  // automaton. The literals are in order of priority, and nliterals is 0 for other regexes.
+  string_slice *literals;
+  int nliterals;
+  bool single_byte;
+  // Work done by all matches since regex_count_stats was called, or NULL before
+  _Atomic(regex_totals *) totals;
+  // The automaton with every transition reversed, which matches the reversed strings. Built when first needed.
+  _Atomic(struct regex *) reverse;
+  // Native code for the automaton, used instead of the dfa once regex_jit compiled it
+  _Atomic(jit_code *) jit;
 } regex;
 
+// Memory used while matching. A regex can be used by several threads at once
+// as long as each thread has its own scratch.
+// Functions that don't take a scratch use one that is private to the calling thread.
+typedef struct regex_scratch regex_scratch;
+regex_scratch *mk_regex_scratch(void);
+void destroy_regex_scratch(regex_scratch *s);
+// The scratch private to the calling thread, used by the functions that don't take one
+regex_scratch *regex_thread_scratch(void);
+
+// Work done while matching, for finding the patterns that are expensive to match
+typedef struct {
+  // Bytes the dfa consumed or skipped over, and of those the bytes skipped in runs a state loops on
+  long dfa_bytes;
+  long run_bytes;
+  // dfa states computed because they weren't cached yet
+  long dfa_states;
+  // Bytes consumed while simulating the nfa, and nfa states visited while doing so
+  long nfa_bytes;
+  long nfa_states;
+  // Matches that simulated the nfa because the dfa exceeded its cache budget
+  long dfa_failures;
+  // Matches given up because they exceeded their budget
+  long aborted;
+} regex_stats;
+
+// The work done by the last match with s
+const regex_stats *regex_scratch_stats(const regex_scratch *s);
+// Give up matches with s once they take more than `steps` steps, and return them with `aborted` set. A step is a
+// byte consumed or skipped by either automaton, or an nfa state visited. 0 means no limit, which is the default.
+// Streams are not bounded.
+void regex_scratch_budget(regex_scratch *s, long steps);
+// Add up the work done by all matches of r from now on, by every thread. Since regexes are shared, this also
+// counts matches of the same pattern compiled elsewhere.
+void regex_count_stats(regex *r);
+// The work done by matches of r since regex_count_stats was called
+regex_stats regex_total_stats(regex *r);
+void regex_print_stats(const regex_stats *s, FILE *f);
+
+// Several patterns compiled into one automaton, so all of them can be matched in a single pass
+typedef struct {
+  regex *r;
+  // Number of patterns
+  int n;
+} regex_set;
+
+// Compile a set of patterns. NULL patterns are allowed and never match.
+regex_set *mk_regex_set(const char **patterns, int n);
+void destroy_regex_set(regex_set *s);
+// Match every pattern at the cursor of ctx, without moving it.
+// ends[i] is set to the length of the leftmost-first match of pattern i, or -1 if it doesn't match.
+// Returns the number of patterns that matched, or -1 if the match was aborted.
+int regex_set_matches(regex_set *s, match_context *ctx, long *ends);
+int regex_set_matches_r(regex_set *s, match_context *ctx, long *ends, regex_scratch *scratch);
+
+// Match at the cursor of ctx like regex_matches, and extract the capture groups in the same pass.
+// groups needs room for r->ngroups + 1 slices. groups[0] is the whole match and groups[i] the last text matched
+// by group i, or a slice with a NULL str if the group took no part in the match.
+regex_match regex_captures(regex *r, match_context *ctx, string_slice *groups);
+regex_match regex_captures_r(regex *r, match_context *ctx, string_slice *groups, regex_scratch *scratch);
+// Find the first match in string like regex_find, with capture groups like regex_captures
+regex_match regex_find_captures(regex *r, const char *string, string_slice *groups);
+regex_match regex_find_captures_r(regex *r, const char *string, string_slice *groups, regex_scratch *scratch);
+
+// Finds the matches of a regex in input that arrives in chunks, without keeping the input around.
+// The matches are the same regex_find finds when called again after the end of every match, or one byte after
+// an empty match.
+typedef struct regex_stream regex_stream;
+typedef struct {
+  bool match;
+  // Offsets of the match from the beginning of the stream
+  long start;
+  long end;
+} regex_stream_match;
+
+regex_stream *mk_regex_stream(regex *r);
+void destroy_regex_stream(regex_stream *s);
+// Consume chunk until a match is complete or the chunk runs out, and return the number of bytes consumed.
+// A match is complete once more input can't change it. It is stored in *m, and the rest of the chunk should be
+// fed again.
+long regex_stream_feed(regex_stream *s, const char *chunk, long n, regex_stream_match *m);
+// Signal the end of the input, and store a match that was waiting for more input in *m.
+// Returns false once there are no matches left, after which the stream starts over at offset 0.
+bool regex_stream_end(regex_stream *s, regex_stream_match *m);
+// Check if more input could complete or extend a match that started in the input fed so far
+bool regex_stream_pending(const regex_stream *s);
+// The offset of the first byte that can still be part of a match. Earlier input doesn't need to be kept.
+long regex_stream_keep(const regex_stream *s);
+
 bool matches(const char *pattern, const char *string);
 regex_match regex_pos(regex *r, const char *string, int len);
 bool regex_matches_strict(regex *r, const char *string);
 regex_match regex_matches(regex *r, match_context *ctx);
+regex_match regex_matches_r(regex *r, match_context *ctx, regex_scratch *scratch);
 regex_match regex_find(regex *r, const char *string);
+regex_match regex_find_r(regex *r, const char *string, regex_scratch *scratch);
+// Like regex_matches and regex_find, but with POSIX leftmost-longest semantics: of the matches that start first,
+// the longest one is taken, regardless of the order of alternatives or the greediness of repetitions.
+regex_match regex_longest(regex *r, match_context *ctx);
+regex_match regex_longest_r(regex *r, match_context *ctx, regex_scratch *scratch);
+regex_match regex_find_longest(regex *r, const char *string);
+regex_match regex_find_longest_r(regex *r, const char *string, regex_scratch *scratch);
+// Find the first match in the n bytes of s, which need not be NUL terminated
+regex_match regex_find_slice(regex *r, string_slice s);
+regex_match regex_find_slice_r(regex *r, string_slice s, regex_scratch *scratch);
+
+// Iterates over the matches in a buffer of known length, which need not be NUL terminated. The matches are the
+// same regex_find finds when called again after the end of every match, or one byte after an empty match.
+// Iterators live wherever the caller puts them and allocate nothing. Each match is searched for from the end of
+// the previous one, so the buffer is read once, besides the bytes past the end of a match the automaton has to
+// look at to know the match can't get longer.
+typedef struct {
+  regex *r;
+  regex_scratch *scratch;
+  string_slice input;
+  // Offset the search for the next match starts from
+  long pos;
+} regex_iter;
+
+// An iterator that uses the scratch of the calling thread, so it can't be passed to other threads
+regex_iter mk_regex_iter(regex *r, string_slice input);
+regex_iter mk_regex_iter_r(regex *r, string_slice input, regex_scratch *scratch);
+// The next match, or one with `match` unset once there are none left.
+// A match given up because of the budget of the scratch ends the iteration.
+regex_match regex_iter_next(regex_iter *it);
+// Call f with every match in s, in order, and return the number of matches. The matches are the ones an iterator
+// over s finds, and f is called by the calling thread. s is split into chunks that up to nthreads threads search
+// at once, each with a scratch of its own, and matches running past the end of a chunk are joined up with those of
+// the next one. Stops early once f returns false. Only worth it for buffers of many megabytes.
+// Each search may take up to budget steps, or any number if it is 0. Like an iterator, a search given up ends the
+// iteration, and f is called with a match with `aborted` set.
+long regex_find_parallel(regex *r, string_slice s, int nthreads, long budget, bool (*f)(regex_match m, void *data),
+                         void *data);
+// The thread pool regex_find_parallel runs on, for searches split some other way. Calls search for every chunk
+// from 0 to nchunks - 1 on up to nthreads threads, each with a scratch of its own with the given budget, or on the
+// calling thread if no thread can be started. Calls done for every chunk in order from the calling thread, once it
+// is searched. Stops handing out chunks once done returns false, and returns once the threads finished the chunks
+// they were searching.
+void regex_search_chunks(int nchunks, int nthreads, long budget,
+                         void (*search)(void *data, int chunk, regex_scratch *scratch),
+                         bool (*done)(void *data, int chunk), void *data);
 void destroy_regex(regex *r);
+// Compile a regex, or take another reference to one compiled from the same pattern recently.
+// The result is shared, so it must not be modified, and every call needs a call to destroy_regex.
 regex *mk_regex(const char *pattern);
 regex *mk_regex_from_slice(string_slice slice);
+// Drop the references the cache of compiled regexes holds. Regexes that are still in use stay valid.
+void regex_cache_clear(void);
+// Compiled regexes can be saved in an image that later processes load instead of compiling them again.
+// Write the automata of n regexes to f. Returns false if writing failed.
+bool regex_save(regex **regexes, int n, FILE *f);
+// Write every regex in the cache to f, like regex_save
+bool regex_save_cache(FILE *f);
+// Add the regexes of an image written by regex_save to the cache, so compiling their patterns takes them from
+// it. The automata are used where they lie, so the n bytes at data must be aligned to 8 bytes and stay valid while
+// the regexes are used, which a mapped file does. Returns the number of regexes loaded, or -1 if data isn't an
+// image written on a machine like this one.
+int regex_load_cache(const void *data, size_t n);
+// Compile r to native code, which regex_matches and regex_find use from then on when their match has no budget.
+// Only supported on x86-64 Linux, and only for automata of up to a thousand states or so. Returns false if r keeps
+// using the interpreter.
+bool regex_jit(regex *r);
+// Compute the full automaton for r, or NULL if it has more than max_states states
+regex_table *mk_regex_table(regex *r, int max_states);
+void destroy_regex_table(regex_table *t);
+// Print the states of r, for debugging
+void regex_dump(const regex *r, FILE *f);
+// Split the classes in c so that bytes r treats differently end up in different classes.
+// c should be zero initialized before the first regex is added.
+void byte_classes_add(byte_classes *c, const regex *r);
 // Get the set of characters that can occur in the beginning of a matching regex
 void regex_first(regex *r, char map[static UINT8_MAX]);
+// Check if ch can be part of a match of r
+bool regex_accepts(const regex *r, u8 ch);
 #endif  // REGEX_H
@@ -24,6 +24,12 @@ typedef struct {
 typedef struct {
   vec tokens;
   parse_context *ctx;
+  // Byte classes of all token patterns
+  byte_classes classes;
+  // All token patterns, matched together by next_token
+  regex_set *set;
+  // Match ends of every token, filled in by the set
+  long *ends;
 } scanner;
 
 typedef struct {
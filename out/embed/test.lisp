@@ -0,0 +1,3 @@
+  0x28, 0x70, 0x72, 0x69, 0x6e, 0x74, 0x20, 0x27, 0x68, 0x65, 0x6c, 0x6c,
+  0x6f, 0x20, 0x3b, 0x20, 0x77, 0x6f, 0x72, 0x6c, 0x64, 0x0a, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x29, 0x0a
@@ -7,6 +7,7 @@
 
 // Arenas should be aligned to page boundaries
 #define PAGESIZE 4096  // (PAGESIZE ? PAGESIZE : (PAGESIZE = sysconf(_SC_PAGESIZE)))
+#define ARENA_ALIGN _Alignof(max_align_t)
 
 static arena *mk_arena_sized(size_t size) {
   // PERFORMANCE: I don't think calloc guarantees a page aligned memory region just because the region would align with
@@ -35,10 +36,12 @@ void destroy_arena(arena *a) {
 void *arena_alloc(arena *head, size_t nmemb, size_t mem_size) {
   arena *tail = head->tail;
 
-  size_t size, required;
+  size_t size, start, required;
 
   size = nmemb * mem_size;
-  required = tail->cursor + size + offsetof(arena, buffer);
+  // Every allocation is aligned like malloc's, so it can hold any type
+  start = (tail->cursor + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+  required = start + size + offsetof(arena, buffer);
 
   if (required > tail->size) {
     arena *new_tail = mk_arena_sized(size);
@@ -46,10 +49,10 @@ void *arena_alloc(arena *head, size_t nmemb, size_t mem_size) {
     tail->next = new_tail;
 
     tail = new_tail;
-    required = tail->cursor + size + offsetof(arena, buffer);
+    start = 0;
   }
 
-  void *ret = tail->buffer + tail->cursor;
-  tail->cursor += size;
+  void *ret = tail->buffer + start;
+  tail->cursor = start + size;
   return ret;
 }
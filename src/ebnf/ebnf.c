@@ -540,6 +540,7 @@ static void init_parser(parser_t *g, scanner s) {
       if (!regexes[i]) {
         die("Failed to compile regex %s\n", patterns[i]);
       }
+      atexit_r((cleanup_func)destroy_regex, regexes[i]);
     }
   }
 }
@@ -1,6 +1,7 @@
 #include "logging.h"
 
 #include <errno.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -60,18 +61,23 @@ static bool should_log(FILE *fp, enum loglevel level) {
 
 void colored_log(FILE *fp, enum loglevel level, const char *fmt, va_list ap) {
   static vec strbuf = {.sz = sizeof(char)};
+  // Guards the shared buffer, so lines logged from several threads don't mix
+  static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  pthread_mutex_lock(&lock);
   if (strbuf.array == NULL) {
     vec_ensure_capacity(&strbuf, 100);
     atexit_r((cleanup_func)vec_destroy, &strbuf);
   }
-  strbuf.n = 0;
   setup_crash_stacktrace_logger();
+  pthread_mutex_unlock(&lock);
   if (!fp)
     return;
   if (log && fp != log)
     colored_log(log, level, fmt, ap);
 
   if (should_log(fp, level)) {
+    pthread_mutex_lock(&lock);
+    strbuf.n = 0;
     const char *color = log_colors[level];
     const char *header = headers[level];
 
@@ -99,6 +105,7 @@ void colored_log(FILE *fp, enum loglevel level, const char *fmt, va_list ap) {
     fflush(fp);
     if (level > most_severe_log)
       most_severe_log = level;
+    pthread_mutex_unlock(&lock);
   }
 }
 
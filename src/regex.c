@@ -1,5 +1,8 @@
 #include "regex.h"
 
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,6 +13,14 @@
 #include "logging.h"
 #include "macros.h"
 #include "text.h"
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+// Matchers can be compiled to native code on x86-64 Linux, unless REGEX_NO_JIT is defined
+#if defined(__x86_64__) && defined(__linux__) && !defined(REGEX_NO_JIT)
+#define REGEX_JIT
+#include <sys/mman.h>
+#endif
 
 // chars 0-10 are not printable and can be freely used as special tokens
 #define DIGIT 3  // \d
@@ -19,8 +30,13 @@
 #define PLUS '+'
 #define OPTIONAL '?'
 #define RANGE '-'
+// Capture slots are 16 bits, and every group needs two
+#define MAX_GROUPS (UINT16_MAX / 2)
+// Counted repetitions are expanded into copies, so they are limited in size
+#define MAX_COUNT 1000
+#define MAX_COUNTED_STATES (1 << 16)
 
-#define add_transition(from, to) (push_nfa(&(from)->lst, (to)))
+#define add_transition(b, from, to) (push_nfa((b)->a, &(from)->lst, (to)))
 #define end_state(state) ((state)->end ? (state)->end : (state))
 #define is_dot(state) ((state)->accept == 0)
 
@@ -28,10 +44,11 @@
  * regex    = {( class | paren | symbol | union )} [ postfix ] regex | ε
  * class    = "[" {( symbol | range )} "]"
  * paren    = "(" regex ")"
- * postfix  = kleene | plus | optional
+ * postfix  = ( kleene | plus | optional | count ) [ "?" ]
  * kleene   = *
  * plus     = +
  * optional = ?
+ * count    = "{" digits [ "," [ digits ] ] "}"
  * union    = regex "|" regex
  * range    = symbol "-" symbol
  * symbol   = char | escaped
@@ -39,9 +56,42 @@
  * escaped  = "\" [ []().* ]
  */
 
-static arena *regex_arena = NULL;
+typedef struct nfa nfa;
 
-static nfa *build_automaton(parse_context *ctx, char terminator);
+typedef struct {
+  size_t n;
+  size_t cap;
+  nfa **arr;
+} nfalist;
+
+// The automaton is built as a graph of nfa states, and laid out as an array of regex_state once complete
+struct nfa {
+  // Possible transitions from this state
+  nfalist lst;
+  // Character accepted by this state
+  u8 accept;
+  // If set and greater than accept, all characters in the range [accept-accept_end] (inclusive) are accepted
+  u8 accept_end;
+  // The end state of this nfa
+  // If NULL, the state itself is considered the end state
+  nfa *end;
+  // Index of this state in the automaton it belongs to
+  int id;
+  // One more than the capture slot this state records the position in, or 0
+  int save;
+};
+
+typedef struct {
+  parse_context ctx;
+  // The arena of the automaton being built
+  arena *a;
+  // Number of states created so far
+  int nstates;
+  // Number of capture groups opened so far
+  int ngroups;
+} builder;
+
+static nfa *build_automaton(builder *b, char terminator);
 static bool mk_nfalist(arena *a, nfalist *lst, size_t cap) {
   nfa **arr = arena_alloc(a, cap, sizeof(nfa *));
   if (arr) {
@@ -53,13 +103,13 @@ static bool mk_nfalist(arena *a, nfalist *lst, size_t cap) {
   return false;
 }
 
-static void push_nfa(nfalist *lst, nfa *d) {
+static void push_nfa(arena *a, nfalist *lst, nfa *d) {
   if (lst->n >= lst->cap) {
     if (lst->arr == NULL)
-      mk_nfalist(regex_arena, lst, 2);
+      mk_nfalist(a, lst, 2);
     else {
       size_t newcap = lst->cap * 2;
-      nfa **arr = arena_alloc(regex_arena, newcap, sizeof(nfa *));
+      nfa **arr = arena_alloc(a, newcap, sizeof(nfa *));
       memcpy(arr, lst->arr, lst->n * sizeof(nfa *));
       lst->arr = arr;
       lst->cap = newcap;
@@ -68,8 +118,9 @@ static void push_nfa(nfalist *lst, nfa *d) {
   lst->arr[lst->n++] = d;
 }
 
-static nfa *mk_state(u8 accept) {
-  nfa *d = arena_alloc(regex_arena, sizeof(nfa), 1);
+static nfa *mk_state(builder *b, u8 accept) {
+  nfa *d = arena_alloc(b->a, sizeof(nfa), 1);
+  d->id = b->nstates++;
   if (accept == DIGIT) {
     d->accept = '0';
     d->accept_end = '9';
@@ -101,7 +152,8 @@ static u8 take_char(parse_context *ctx) {
   return ch;
 }
 
-static nfa *match_symbol(parse_context *ctx, bool class_match) {
+static nfa *match_symbol(builder *b, bool class_match) {
+  parse_context *ctx = &b->ctx;
   if (finished(ctx))
     return NULL;
   bool escaped = peek(ctx) == '\\';
@@ -110,9 +162,9 @@ static nfa *match_symbol(parse_context *ctx, bool class_match) {
     return NULL;
   if (escaped) {
     if (ch == 'd')
-      return mk_state(DIGIT);
+      return mk_state(b, DIGIT);
     else
-      return mk_state(ch);
+      return mk_state(b, ch);
   }
 
   switch (ch) {
@@ -123,7 +175,7 @@ static nfa *match_symbol(parse_context *ctx, bool class_match) {
     case '*':
     case '?':
       if (class_match) {
-        return mk_state(ch);
+        return mk_state(b, ch);
         break;
       }
       // else fall through
@@ -135,15 +187,16 @@ static nfa *match_symbol(parse_context *ctx, bool class_match) {
       return NULL;
       break;
     case '.':
-      return mk_state(class_match ? ch : DOT);
+      return mk_state(b, class_match ? ch : DOT);
       break;
     default:
-      return mk_state(ch);
+      return mk_state(b, ch);
       break;
   }
 }
 
-static nfa *match_class(parse_context *ctx) {
+static nfa *match_class(builder *b) {
+  parse_context *ctx = &b->ctx;
   nfa *class, *final;
   bool bitmap[UINT8_MAX] = {0};
   bool negate = false;
@@ -159,7 +212,7 @@ static nfa *match_class(parse_context *ctx) {
         advance(ctx);
       }
     }
-    return mk_state(DOT);
+    return mk_state(b, DOT);
   }
 
   if (peek(ctx) == '^') {
@@ -172,8 +225,8 @@ static nfa *match_class(parse_context *ctx) {
     return NULL;
   }
 
-  class = mk_state(EPSILON);
-  final = mk_state(EPSILON);
+  class = mk_state(b, EPSILON);
+  final = mk_state(b, EPSILON);
   class->end = final;
 
   while (peek(ctx) != ']' && finished(ctx) == false) {
@@ -209,11 +262,11 @@ static nfa *match_class(parse_context *ctx) {
       int end;
       for (end = start + 1; end < UINT8_MAX && bitmap[end]; end++) {
       }
-      nfa *new = mk_state(start);
+      nfa *new = mk_state(b, start);
       // accept_end is inclusive
       new->accept_end = end - 1;
-      add_transition(new, final);
-      add_transition(class, new);
+      add_transition(b, new, final);
+      add_transition(b, class, new);
       start = end;
     }
   }
@@ -223,13 +276,14 @@ static nfa *match_class(parse_context *ctx) {
 
 typedef nfa *(*matcher)(parse_context *);
 
-static nfa *next_match(parse_context *ctx, char terminator) {
+static nfa *next_match(builder *b, char terminator) {
+  parse_context *ctx = &b->ctx;
   nfa *result = NULL;
   u8 ch = peek(ctx);
   switch (ch) {
     case '[':
       advance(ctx);
-      result = match_class(ctx);
+      result = match_class(b);
       if (take(ctx) != ']') {
         return NULL;
       }
@@ -245,32 +299,180 @@ static nfa *next_match(parse_context *ctx, char terminator) {
         error("Unmatched group terminator.");
       return NULL;
       break;
-    case '(':
+    case '(': {
       advance(ctx);
-      result = build_automaton(ctx, ')');
-      if (take(ctx) != ')')
+      // The group is wrapped in states saving where it starts and ends
+      int group = b->ngroups++;
+      if (group == MAX_GROUPS) {
+        error("Too many capture groups.");
         return NULL;
-      break;
+      }
+      nfa *open = mk_state(b, EPSILON);
+      nfa *inner = build_automaton(b, ')');
+      if (inner == NULL || take(ctx) != ')')
+        return NULL;
+      nfa *close = mk_state(b, EPSILON);
+      open->save = 2 * group + 1;
+      close->save = 2 * group + 2;
+      add_transition(b, open, inner);
+      add_transition(b, end_state(inner), close);
+      open->end = close;
+      result = open;
+    } break;
     default:
-      result = match_symbol(ctx, false);
+      result = match_symbol(b, false);
       break;
   }
   return result;
 }
 
-static nfa *build_automaton(parse_context *ctx, char terminator) {
+// Wrap new in a loop, or make it optional.
+// Returns the start of the result, which ends at its end_state.
+static nfa *quantify(builder *b, nfa *new, bool greedy, bool optional, bool repeatable) {
+  nfa *loop_start = mk_state(b, EPSILON);
+  nfa *loop_end = mk_state(b, EPSILON);
+  nfa *new_end = end_state(new);
+  loop_start->end = loop_end;
+
+  // The order of transitions is crucial because the matching algorithm
+  // traverses the automaton in a depth-first fashion. A greedy match is
+  // achieved by preferring to enter the loop again, and a non-greedy match
+  // is achieved by preferring to exit the loop as early as possible.
+  if (greedy) {
+    if (repeatable)
+      add_transition(b, new_end, loop_start);
+
+    add_transition(b, new_end, loop_end);
+    add_transition(b, loop_start, new);
+    if (optional)
+      add_transition(b, loop_start, loop_end);
+
+  } else {
+    add_transition(b, new_end, loop_end);
+    if (repeatable)
+      add_transition(b, new_end, loop_start);
+
+    if (optional)
+      add_transition(b, loop_start, loop_end);
+
+    add_transition(b, loop_start, new);
+  }
+  return loop_start;
+}
+
+// Counts above MAX_COUNT are read as MAX_COUNT + 1, so they can't overflow
+static int take_count(parse_context *ctx) {
+  int n = 0;
+  if (peek(ctx) < '0' || peek(ctx) > '9')
+    return -1;
+  while (peek(ctx) >= '0' && peek(ctx) <= '9') {
+    n = n * 10 + (take(ctx) - '0');
+    if (n > MAX_COUNT)
+      n = MAX_COUNT + 1;
+  }
+  return n;
+}
+
+// Parse {m}, {m,} or {m,n}, with -1 for a missing maximum.
+// If there is no valid count, nothing is consumed and the brace is a literal.
+static bool take_counts(parse_context *ctx, int *min, int *max) {
+  int at = ctx->c;
+  if (peek(ctx) == '{') {
+    advance(ctx);
+    *min = *max = take_count(ctx);
+    if (*min >= 0 && peek(ctx) == ',') {
+      advance(ctx);
+      *max = peek(ctx) == '}' ? -1 : take_count(ctx);
+      if (*max == -1 && peek(ctx) != '}')
+        *min = -1;
+    }
+    if (*min >= 0 && take(ctx) == '}')
+      return true;
+  }
+  ctx->c = at;
+  return false;
+}
+
+// Parse the atom at `at` again for another copy of a counted repetition.
+// The copies of a capture group share its slots, so the last one to match is captured.
+static nfa *copy_atom(builder *b, int at, int groups, char terminator) {
+  b->ctx.c = at;
+  b->ngroups = groups;
+  return next_match(b, terminator);
+}
+
+// Expand atom{min,max}: min copies of the atom, followed by either a loop or max - min nested optional copies.
+// The atom was parsed at `at`, when `groups` capture groups were opened before it.
+static nfa *counted(builder *b, nfa *atom, int at, int groups, int min, int max, bool greedy, char terminator) {
+  parse_context *ctx = &b->ctx;
+  int after = ctx->c;
+  int groups_after = b->ngroups;
+  int copies = max < 0 ? min + 1 : max;
+  if (min > MAX_COUNT || max > MAX_COUNT) {
+    error("Repetition is too large.");
+    return NULL;
+  }
+  if (max >= 0 && max < min) {
+    error("Invalid repetition {%d,%d}.", min, max);
+    return NULL;
+  }
+  // The states of the atom were created last
+  if ((long)copies * (b->nstates - atom->id) > MAX_COUNTED_STATES) {
+    error("Repetition is too large.");
+    return NULL;
+  }
+
+  nfa *start = mk_state(b, EPSILON);
+  nfa *end = start;
+  for (int i = 0; i < min; i++) {
+    nfa *copy = i == 0 ? atom : copy_atom(b, at, groups, terminator);
+    add_transition(b, end, copy);
+    end = end_state(copy);
+  }
+  if (max < 0) {
+    nfa *loop = quantify(b, min == 0 ? atom : copy_atom(b, at, groups, terminator), greedy, true, true);
+    add_transition(b, end, loop);
+    end = end_state(loop);
+  } else if (max > min) {
+    // x{0,3} is (x(x(x)?)?)?, so there is only one way to match any number of copies
+    nfa *optional = NULL;
+    for (int i = max - 1; i >= min; i--) {
+      nfa *copy = i == 0 ? atom : copy_atom(b, at, groups, terminator);
+      if (optional) {
+        nfa *seq = mk_state(b, EPSILON);
+        add_transition(b, seq, copy);
+        add_transition(b, end_state(copy), optional);
+        seq->end = end_state(optional);
+        copy = seq;
+      }
+      optional = quantify(b, copy, greedy, true, false);
+    }
+    add_transition(b, end, optional);
+    end = end_state(optional);
+  }
+  start->end = end;
+  ctx->c = after;
+  b->ngroups = groups_after;
+  return start;
+}
+
+static nfa *build_automaton(builder *b, char terminator) {
+  parse_context *ctx = &b->ctx;
   nfa *left, *right;
   nfa *next, *start;
-  start = next = mk_state(EPSILON);
+  start = next = mk_state(b, EPSILON);
   left = right = NULL;
 
   while (!finished(ctx)) {
-    nfa *new = next_match(ctx, terminator);
+    int at = ctx->c;
+    int groups = b->ngroups;
+    nfa *new = next_match(b, terminator);
     if (new == NULL) {
       break;
     }
 
     u8 ch = peek(ctx);
+    int min, max;
     if (ch == KLEENE || ch == PLUS || ch == OPTIONAL) {
       advance(ctx);
 
@@ -283,59 +485,41 @@ static nfa *build_automaton(parse_context *ctx, char terminator) {
         advance(ctx);
       }
 
-      nfa *loop_start = mk_state(EPSILON);
-      nfa *loop_end = mk_state(EPSILON);
-      nfa *new_end = end_state(new);
-
-      add_transition(next, loop_start);
-      next = loop_end;
-
-      // The order of transitions is crucial because the matching algorithm
-      // traverses the automaton in a depth-first fashion. A greedy match is
-      // achieved by preferring to enter the loop again, and a non-greedy match
-      // is achieved by preferring to exit the loop as early as possible.
-      if (greedy) {
-        if (repeatable)
-          add_transition(new_end, loop_start);
-
-        add_transition(new_end, loop_end);
-        add_transition(loop_start, new);
-        if (optional)
-          add_transition(loop_start, loop_end);
-
-      } else {
-        add_transition(new_end, loop_end);
-        if (repeatable)
-          add_transition(new_end, loop_start);
-
-        if (optional)
-          add_transition(loop_start, loop_end);
-
-        add_transition(loop_start, new);
+      new = quantify(b, new, greedy, optional, repeatable);
+    } else if (take_counts(ctx, &min, &max)) {
+      bool greedy = true;
+      if (peek(ctx) == OPTIONAL) {
+        greedy = false;
+        advance(ctx);
+      }
+      new = counted(b, new, at, groups, min, max, greedy, terminator);
+      if (new == NULL) {
+        // Leave the input unfinished, so the regex is invalid
+        ctx->c = at;
+        break;
       }
-    } else {
-      add_transition(next, new);
-      next = end_state(new);
     }
+    add_transition(b, next, new);
+    next = end_state(new);
 
     start->end = next;
 
     if (peek(ctx) == '|') {
       advance(ctx);
       left = start;
-      right = build_automaton(ctx, terminator);
+      right = build_automaton(b, terminator);
       if (right == NULL) {
         return NULL;
       }
-      nfa *parent = mk_state(EPSILON);
-      add_transition(parent, left);
-      add_transition(parent, right);
+      nfa *parent = mk_state(b, EPSILON);
+      add_transition(b, parent, left);
+      add_transition(b, parent, right);
       start = parent;
-      next = mk_state(EPSILON);
+      next = mk_state(b, EPSILON);
       nfa *left_end = end_state(left);
       nfa *right_end = end_state(right);
-      add_transition(left_end, next);
-      add_transition(right_end, next);
+      add_transition(b, left_end, next);
+      add_transition(b, right_end, next);
     }
   }
 
@@ -343,191 +527,3206 @@ static nfa *build_automaton(parse_context *ctx, char terminator) {
   return start;
 }
 
-static bool match_nfa(nfa *d, match_context *ctx) {
-  if (d == NULL)
-    return finished(ctx);
-  u8 ch;
-  if (d->accept != EPSILON) {
-    if (finished(ctx))
-      return false;
-    ch = take(ctx);
-    if (ch < d->accept || ch > d->accept_end)
-      return false;
-  }
+/* Compiled automaton
+ * Once built, the graph is laid out as one array of states with 32 bit indices, and the transitions of all states
+ * in another array. States are numbered depth first from the start, so states that follow each other are usually
+ * close in memory. All states at the end of the automaton are merged into a single STATE_MATCH, and consuming
+ * states without transitions lead to it. A set gets one match state per pattern instead.
+ */
+
+enum state_kind {
+  // Consumes a character in [lo, hi]
+  STATE_CHAR,
+  // Follows its transitions without consuming anything
+  STATE_SPLIT,
+  // Records the position in a capture slot, then follows its transitions
+  STATE_SAVE,
+  // The end of the automaton
+  STATE_MATCH,
+};
+
+#define transitions(r, i) ((r)->edges + (r)->states[i].out)
+#define ntransitions(r, i) ((r)->states[(i) + 1].out - (r)->states[i].out)
 
-  for (size_t i = 0; i < d->lst.n; i++) {
-    nfa *next = d->lst.arr[i];
-    ssize_t pos = ctx->c;
-    // avoid infinite recursion if there is no progress
-    if (next->progress == pos)
+// Lay out the graph reachable from start in r.
+// For sets, group is the pattern of every nfa state, and every pattern gets its own match state.
+static void flatten(regex *r, nfa *start, int nstates, const int *group, int ngroups) {
+  // One more than the index of every numbered state
+  uint32_t *index = ecalloc(nstates, sizeof(uint32_t));
+  // The nfa state at every index, or NULL for match states
+  nfa **order = ecalloc(nstates + ngroups, sizeof(nfa *));
+  // The group of every index
+  int *owner = ecalloc(nstates + ngroups, sizeof(int));
+  // One more than the index of the match state of every group
+  uint32_t *match = ecalloc(ngroups, sizeof(uint32_t));
+  int n = 0;
+  size_t nedges = 0;
+  vec stack = v_make(nfa *);
+  vec_push(&stack, &start);
+  while (stack.n) {
+    nfa *s = *(nfa **)vec_pop(&stack);
+    if (index[s->id])
       continue;
-    next->progress = pos;
-    if (match_nfa(next, ctx))
-      return true;
-    ctx->c = pos;
+    int g = group ? group[s->id] : 0;
+    if (s->accept == EPSILON && !s->save && s->lst.n == 0) {
+      if (!match[g]) {
+        match[g] = ++n;
+        owner[n - 1] = g;
+      }
+      index[s->id] = match[g];
+      continue;
+    }
+    index[s->id] = ++n;
+    order[n - 1] = s;
+    owner[n - 1] = g;
+    nedges += s->lst.n ? s->lst.n : 1;
+    if (s->lst.n == 0 && !match[g]) {
+      // A consuming or save state at the end leads to the match state
+      match[g] = ++n;
+      owner[n - 1] = g;
+    }
+    for (size_t i = s->lst.n; i-- > 0;)
+      vec_push(&stack, &s->lst.arr[i]);
   }
+  vec_destroy(&stack);
 
-  return finished(ctx) && d->lst.n == 0;
+  r->nstates = n;
+  r->states = arena_alloc(r->a, n + 1, sizeof(regex_state));
+  r->edges = arena_alloc(r->a, nedges + 1, sizeof(uint32_t));
+  if (group) {
+    r->pattern = arena_alloc(r->a, n, sizeof(int));
+    memcpy(r->pattern, owner, n * sizeof(int));
+  }
+  uint32_t e = 0;
+  for (int i = 0; i < n; i++) {
+    nfa *s = order[i];
+    regex_state *st = &r->states[i];
+    *st = (regex_state){.out = e};
+    if (s == NULL) {
+      st->kind = STATE_MATCH;
+      continue;
+    }
+    if (s->save) {
+      st->kind = STATE_SAVE;
+      st->slot = s->save - 1;
+    } else if (s->accept == EPSILON) {
+      st->kind = STATE_SPLIT;
+    } else {
+      st->kind = STATE_CHAR;
+      st->lo = s->accept;
+      st->hi = s->accept_end;
+    }
+    if (s->lst.n == 0)
+      r->edges[e++] = match[owner[i]] - 1;
+    for (size_t j = 0; j < s->lst.n; j++)
+      r->edges[e++] = index[s->lst.arr[j]->id] - 1;
+  }
+  r->states[n] = (regex_state){.out = e};
+  free(index);
+  free(order);
+  free(owner);
+  free(match);
 }
 
-static bool partial_match(nfa *d, match_context *ctx) {
-  if (d == NULL)
-    return finished(ctx);
-  u8 ch;
-  if (d->accept != EPSILON) {
-    if (finished(ctx))
-      return false;
-    ch = take(ctx);
-    if (ch < d->accept || ch > d->accept_end)
-      return false;
+/* Optimization
+ * The parser adds epsilon states for every quantifier, alternation and class, which the nfa simulation has to hop
+ * through on every step. Once laid out, transitions into split states are replaced by the states they lead to, in
+ * the order a depth first search reaches them, which keeps the priorities. Then identical states are merged, and
+ * consuming states for adjacent ranges that are tried one after the other and lead to the same states are coalesced.
+ * Save states are kept, since captures depend on them.
+ */
+
+// Transitions that would be replaced by more states than this are kept, so the number of edges can't blow up
+#define MAX_FRONTIER 16
+// Limits the work of following long chains of split states
+#define MAX_EPSILON_VISITS 1024
+
+// An automaton being optimized, with the transitions of every state in their own array
+typedef struct {
+  int n;
+  int cap;
+  regex_state *states;
+  // For sets, the pattern of every state
+  int *pattern;
+  uint32_t **out;
+  uint32_t *nout;
+} graph;
+
+static int graph_add(graph *g, regex_state st, int pattern, const uint32_t *out, uint32_t nout) {
+  if (g->n == g->cap) {
+    g->cap = g->cap ? g->cap * 2 : 16;
+    g->states = erealloc(g->states, g->cap, sizeof(regex_state));
+    g->pattern = erealloc(g->pattern, g->cap, sizeof(int));
+    g->out = erealloc(g->out, g->cap, sizeof(uint32_t *));
+    g->nout = erealloc(g->nout, g->cap, sizeof(uint32_t));
   }
+  g->states[g->n] = st;
+  g->pattern[g->n] = pattern;
+  g->out[g->n] = ecalloc(nout + 1, sizeof(uint32_t));
+  memcpy(g->out[g->n], out, nout * sizeof(uint32_t));
+  g->nout[g->n] = nout;
+  return g->n++;
+}
+
+static void destroy_graph(graph *g) {
+  for (int i = 0; i < g->n; i++)
+    free(g->out[i]);
+  free(g->states);
+  free(g->pattern);
+  free(g->out);
+  free(g->nout);
+}
 
-  for (size_t i = 0; i < d->lst.n; i++) {
-    nfa *next = d->lst.arr[i];
-    ssize_t pos = ctx->c;
-    // avoid infinite recursion if there is no progress
-    if (next->progress == pos)
+// Replace the transitions into split states by the states a depth first search through them reaches.
+// Only the start state is still a split state afterwards, the others become unreachable.
+static void eliminate_epsilons(graph *g) {
+  unsigned *marks = ecalloc(g->n, sizeof(unsigned));
+  uint32_t frontier[MAX_FRONTIER];
+  vec stack = v_make(uint32_t);
+  for (int i = 0; i < g->n; i++) {
+    if (i > 0 && g->states[i].kind == STATE_SPLIT)
       continue;
-    next->progress = pos;
-    if (partial_match(next, ctx))
-      return true;
-    ctx->c = pos;
+    int n = 0, visits = 0;
+    bool ok = true;
+    stack.n = 0;
+    for (uint32_t j = g->nout[i]; j-- > 0;)
+      vec_push(&stack, &g->out[i][j]);
+    while (stack.n && ok) {
+      uint32_t s = *(uint32_t *)vec_pop(&stack);
+      if (marks[s] == (unsigned)i + 1)
+        continue;
+      marks[s] = i + 1;
+      if (g->states[s].kind == STATE_SPLIT) {
+        ok = ++visits <= MAX_EPSILON_VISITS;
+        for (uint32_t j = g->nout[s]; j-- > 0;)
+          vec_push(&stack, &g->out[s][j]);
+      } else if (n == MAX_FRONTIER) {
+        ok = false;
+      } else {
+        frontier[n++] = s;
+      }
+    }
+    // A split state that only leads back to itself has nothing to replace it with
+    if (ok && n > 0) {
+      memcpy(g->out[i], frontier, (n < (int)g->nout[i] ? n : (int)g->nout[i]) * sizeof(uint32_t));
+      if (n > (int)g->nout[i]) {
+        free(g->out[i]);
+        g->out[i] = ecalloc(n, sizeof(uint32_t));
+        memcpy(g->out[i], frontier, n * sizeof(uint32_t));
+      }
+      g->nout[i] = n;
+    }
   }
+  vec_destroy(&stack);
+  free(marks);
+}
 
-  return d->lst.n == 0;
+static size_t hash_state(const graph *g, int i) {
+  // FNV-1a
+  size_t h = 14695981039346656037ull;
+  size_t key[] = {g->states[i].kind, g->states[i].slot, g->pattern[i]};
+  for (int j = 0; j < LENGTH(key); j++) {
+    h ^= key[j];
+    h *= 1099511628211ull;
+  }
+  for (uint32_t j = 0; j < g->nout[i]; j++) {
+    h ^= g->out[i][j];
+    h *= 1099511628211ull;
+  }
+  return h;
 }
 
-// Reset the progress of all nodes in the nfa
-static void reset(nfa *d) {
-  if (d) {
-    d->progress = -1;
-    for (size_t i = 0; i < d->lst.n; i++) {
-      nfa *next = d->lst.arr[i];
-      if (next->progress == -1)
+// The slot covers the range of consuming states, and is zero for split and match states
+static bool same_transitions(const graph *g, int a, int b) {
+  return g->nout[a] == g->nout[b] && memcmp(g->out[a], g->out[b], g->nout[a] * sizeof(uint32_t)) == 0;
+}
+
+static bool same_state(const graph *g, int a, int b) {
+  return g->states[a].kind == g->states[b].kind && g->states[a].slot == g->states[b].slot &&
+         g->pattern[a] == g->pattern[b] && same_transitions(g, a, b);
+}
+
+static uint32_t find_rep(const uint32_t *rep, uint32_t i) {
+  while (rep[i] != i)
+    i = rep[i];
+  return i;
+}
+
+// Point transitions at the representatives of merged states, and drop repeated targets.
+// A repeated target has a lower priority, and is never added since the first one is.
+static void canonical_transitions(graph *g, const uint32_t *rep, int i) {
+  uint32_t n = 0;
+  for (uint32_t j = 0; j < g->nout[i]; j++) {
+    uint32_t to = find_rep(rep, g->out[i][j]);
+    bool seen = false;
+    for (uint32_t k = 0; k < n && !seen; k++)
+      seen = g->out[i][k] == to;
+    if (!seen)
+      g->out[i][n++] = to;
+  }
+  g->nout[i] = n;
+}
+
+// Merge states of the same kind and pattern that have the same transitions, until no more are the same.
+// rep is set to the state every state was merged into.
+static void merge_states(graph *g, uint32_t *rep) {
+  for (int i = 0; i < g->n; i++)
+    rep[i] = i;
+  size_t size = 16;
+  while (size < 2 * (size_t)g->n)
+    size *= 2;
+  int *table = ecalloc(size, sizeof(int));
+  for (bool changed = true; changed;) {
+    changed = false;
+    memset(table, -1, size * sizeof(int));
+    for (int i = 0; i < g->n; i++) {
+      if (rep[i] != (uint32_t)i)
+        continue;
+      canonical_transitions(g, rep, i);
+      size_t h = hash_state(g, i) & (size - 1);
+      while (table[h] >= 0 && !same_state(g, table[h], i))
+        h = (h + 1) & (size - 1);
+      if (table[h] >= 0) {
+        rep[i] = table[h];
+        changed = true;
+      } else {
+        table[h] = i;
+      }
+    }
+  }
+  free(table);
+}
+
+// Coalesce consuming states that follow each other in a list of transitions, accept adjacent ranges, and lead to
+// the same states. At most one of them accepts any character, so the order between them doesn't matter.
+static bool coalesce_ranges(graph *g) {
+  bool changed = false;
+  for (int i = 0; i < g->n; i++) {
+    for (uint32_t j = 0; j + 1 < g->nout[i];) {
+      uint32_t a = g->out[i][j], b = g->out[i][j + 1];
+      regex_state sa = g->states[a], sb = g->states[b];
+      bool adjacent = sa.hi + 1 == sb.lo || sb.hi + 1 == sa.lo;
+      if (sa.kind != STATE_CHAR || sb.kind != STATE_CHAR || !adjacent || g->pattern[a] != g->pattern[b] ||
+          !same_transitions(g, a, b)) {
+        j++;
         continue;
-      reset(next);
+      }
+      regex_state st = {.kind = STATE_CHAR, .lo = sa.lo < sb.lo ? sa.lo : sb.lo, .hi = sa.hi > sb.hi ? sa.hi : sb.hi};
+      // Adding a state may move the arrays
+      uint32_t c = graph_add(g, st, g->pattern[a], g->out[a], g->nout[a]);
+      g->out[i][j] = c;
+      memmove(&g->out[i][j + 1], &g->out[i][j + 2], (g->nout[i] - j - 2) * sizeof(uint32_t));
+      g->nout[i]--;
+      changed = true;
     }
   }
+  return changed;
 }
 
-void destroy_regex(regex *r) { (void)r; }
+static void optimize(regex *r) {
+  graph g = {0};
+  for (int i = 0; i < r->nstates; i++)
+    graph_add(&g, r->states[i], r->pattern ? r->pattern[i] : 0, transitions(r, i), ntransitions(r, i));
+  int nedges = r->states[r->nstates].out;
 
-regex *mk_regex_from_slice(string_slice slice) {
-  if (!regex_arena) {
-    regex_arena = mk_arena();
-    atexit_r((cleanup_func)destroy_arena, regex_arena);
+  eliminate_epsilons(&g);
+  uint32_t *rep = ecalloc(g.n, sizeof(uint32_t));
+  merge_states(&g, rep);
+  if (coalesce_ranges(&g)) {
+    rep = erealloc(rep, g.n, sizeof(uint32_t));
+    merge_states(&g, rep);
   }
 
-  regex *r = NULL;
-  if (slice.str == NULL)
-    error("NULL string");
-  if (slice.str) {
-    char *copy = arena_alloc(regex_arena, slice.n + 1, 1);
-    memcpy(copy, slice.str, slice.n);
-    r = arena_alloc(regex_arena, 1, sizeof(regex));
-    r->ctx = (parse_context){
-        .view = {.n = slice.n, .str = copy}
-    };
-    r->start = build_automaton(&r->ctx, 0);
-    reset(r->start);
-    if (!finished(&r->ctx)) {
-      debug("Invalid regex '%S'", slice);
-      destroy_regex(r);
-      return NULL;
+  // Lay out the states reachable from the start again, numbered depth first
+  uint32_t *index = ecalloc(g.n, sizeof(uint32_t));
+  uint32_t *order = ecalloc(g.n, sizeof(uint32_t));
+  int n = 0;
+  size_t edges = 0;
+  vec stack = v_make(uint32_t);
+  uint32_t start = 0;
+  vec_push(&stack, &start);
+  while (stack.n) {
+    uint32_t s = find_rep(rep, *(uint32_t *)vec_pop(&stack));
+    if (index[s])
+      continue;
+    index[s] = ++n;
+    order[n - 1] = s;
+    canonical_transitions(&g, rep, s);
+    edges += g.nout[s];
+    for (uint32_t j = g.nout[s]; j-- > 0;)
+      vec_push(&stack, &g.out[s][j]);
+  }
+  vec_destroy(&stack);
+
+  // The optimized automaton usually fits where the old one was
+  if (n > r->nstates)
+    r->states = arena_alloc(r->a, n + 1, sizeof(regex_state));
+  if (edges > (size_t)nedges)
+    r->edges = arena_alloc(r->a, edges + 1, sizeof(uint32_t));
+  if (r->pattern && n > r->nstates)
+    r->pattern = arena_alloc(r->a, n, sizeof(int));
+  uint32_t e = 0;
+  for (int i = 0; i < n; i++) {
+    uint32_t s = order[i];
+    r->states[i] = g.states[s];
+    r->states[i].out = e;
+    if (r->pattern)
+      r->pattern[i] = g.pattern[s];
+    for (uint32_t j = 0; j < g.nout[s]; j++)
+      r->edges[e++] = index[g.out[s][j]] - 1;
+  }
+  r->states[n] = (regex_state){.out = e};
+  debug("Optimized automaton from %d states and %d edges to %d states and %d edges", r->nstates, nedges, n, (int)e);
+  r->nstates = n;
+
+  free(index);
+  free(order);
+  free(rep);
+  destroy_graph(&g);
+}
+
+void regex_dump(const regex *r, FILE *f) {
+  static const char *kinds[] = {[STATE_CHAR] = "char", [STATE_SPLIT] = "split", [STATE_SAVE] = "save", [STATE_MATCH] = "match"};
+  fprintf(f, "%d states, %d edges\n", r->nstates, (int)r->states[r->nstates].out);
+  for (int i = 0; i < r->nstates; i++) {
+    const regex_state *st = &r->states[i];
+    fprintf(f, "%4d %-5s", i, kinds[st->kind]);
+    if (st->kind == STATE_CHAR)
+      fprintf(f, " [%d-%d]", st->lo, st->hi);
+    else if (st->kind == STATE_SAVE)
+      fprintf(f, " %d", st->slot);
+    if (r->pattern)
+      fprintf(f, " pattern %d", r->pattern[i]);
+    fprintf(f, " ->");
+    for (uint32_t j = 0; j < ntransitions(r, i); j++)
+      fprintf(f, " %u", transitions(r, i)[j]);
+    fprintf(f, "\n");
+  }
+}
+
+void byte_classes_add(byte_classes *c, const regex *r) {
+  // Bytes that start a new class
+  bool boundary[UINT8_MAX + 2] = {[0] = true};
+  for (int i = 1; i <= UINT8_MAX; i++)
+    boundary[i] = c->map[i] != c->map[i - 1];
+  for (int i = 0; i < r->nstates; i++) {
+    if (r->states[i].kind == STATE_CHAR) {
+      boundary[r->states[i].lo] = true;
+      boundary[r->states[i].hi + 1] = true;
     }
   }
-  return r;
+  c->n = 0;
+  for (int i = 0; i <= UINT8_MAX; i++) {
+    c->n += boundary[i] && i > 0;
+    c->map[i] = c->n;
+  }
+  c->n++;
 }
 
-regex *mk_regex(const char *pattern) {
-  string_slice s = {.n = strlen(pattern), .str = pattern};
-  regex *r = mk_regex_from_slice(s);
-  return r;
+/* Literals
+ * Every match of most patterns starts with, or at least contains, some fixed string. regex_find uses them to
+ * skip input that can't contain a match with memchr/memmem, instead of trying to match at every offset.
+ */
+
+// Longest literal extracted from a regex
+#define MAX_LITERAL 64
+// Finding required literals is quadratic in the number of states, so larger automata are not analyzed
+#define MAX_LITERAL_STATES 2048
+
+typedef struct {
+  const regex *r;
+  bool *seen;
+  vec stack;
+  // Consuming states reached
+  uint32_t *states;
+  int n;
+  // Set if the end of the automaton was reached
+  bool match;
+} reach;
+
+static void reach_clear(reach *c) {
+  memset(c->seen, 0, c->r->nstates * sizeof(bool));
+  c->n = 0;
+  c->match = false;
 }
 
-regex_match regex_pos(regex *r, const char *string, int len) {
-  regex_match result = {0};
-  if (!string)
-    return result;
-  if (len <= 0)
-    len = strlen(string);
-  match_context m = {
-      .view = {.n = len, .str = string}
-  };
-  reset(r->start);
-  bool match = partial_match(r->start, &m);
-  if (match) {
-    result.match = true;
-    result.matched = (string_slice){.n = m.c, .str = string};
+// Collect the consuming states reachable from `from` without consuming anything
+static void epsilon_closure(reach *c, const uint32_t *from, size_t n) {
+  const regex *r = c->r;
+  vec *stack = &c->stack;
+  stack->n = 0;
+  for (size_t i = 0; i < n; i++)
+    vec_push(stack, &from[i]);
+  while (stack->n) {
+    uint32_t i = *(uint32_t *)vec_pop(stack);
+    if (c->seen[i])
+      continue;
+    c->seen[i] = true;
+    if (r->states[i].kind == STATE_CHAR)
+      c->states[c->n++] = i;
+    else if (r->states[i].kind == STATE_MATCH)
+      c->match = true;
+    else
+      for (uint32_t j = 0; j < ntransitions(r, i); j++)
+        vec_push(stack, &transitions(r, i)[j]);
   }
-  return result;
 }
 
-regex_match regex_matches(regex *r, match_context *ctx) {
-  if (r == NULL)
-    error("NULL regex");
-  size_t pos = ctx->c;
-  reset(r->start);
-  bool match = partial_match(r->start, ctx);
-  if (match) {
-    regex_match result = {0};
-    result.match = true;
-    result.matched = (string_slice){.n = ctx->c - pos, .str = ctx->view.str + pos};
-    return result;
-  } else {
-    regex_match no_match = {0};
-    ctx->c = pos;
-    return no_match;
+// Check if the end of the automaton can be reached from the start without passing through `avoid`
+static bool reaches_end(reach *c, uint32_t avoid) {
+  const regex *r = c->r;
+  vec *stack = &c->stack;
+  stack->n = 0;
+  uint32_t start = 0;
+  vec_push(stack, &start);
+  c->seen[avoid] = true;
+  while (stack->n) {
+    uint32_t i = *(uint32_t *)vec_pop(stack);
+    if (c->seen[i])
+      continue;
+    c->seen[i] = true;
+    if (r->states[i].kind == STATE_MATCH)
+      return true;
+    for (uint32_t j = 0; j < ntransitions(r, i); j++)
+      vec_push(stack, &transitions(r, i)[j]);
   }
+  return false;
 }
 
-bool regex_matches_strict(regex *r, const char *string) {
-  match_context m = mk_ctx(string);
-  reset(r->start);
-  return match_nfa(r->start, &m);
+// Find the string every path through the consuming states in `from` must start with.
+// `from` is overwritten.
+static int literal_from(reach *c, uint32_t *from, int n, char buf[static MAX_LITERAL]) {
+  const regex *r = c->r;
+  int len = 0;
+  while (n && len < MAX_LITERAL) {
+    u8 ch = r->states[from[0]].lo;
+    for (int i = 0; i < n; i++) {
+      if (r->states[from[i]].lo != ch || r->states[from[i]].hi != ch)
+        return len;
+    }
+    buf[len++] = ch;
+
+    reach_clear(c);
+    for (int i = 0; i < n; i++)
+      epsilon_closure(c, transitions(r, from[i]), ntransitions(r, from[i]));
+    if (c->match)
+      break;
+    memcpy(from, c->states, c->n * sizeof(uint32_t));
+    n = c->n;
+  }
+  return len;
 }
 
-regex_match regex_find(regex *r, const char *string) {
-  match_context m = mk_ctx(string);
-  for (int i = 0; i < m.view.n; i++) {
-    reset(r->start);
-    m.c = i;
-    if (partial_match(r->start, &m)) {
-      return (regex_match){
-          .matched = {.n = m.c - i, .str = m.view.str + i},
-          .match = true,
-      };
+static string_slice copy_literal(arena *a, const char *buf, int n) {
+  char *str = arena_alloc(a, n, 1);
+  if (n > 0)
+    memcpy(str, buf, n);
+  return (string_slice){.n = n, .str = str};
+}
+
+// Fill in the literals and first characters of r used by regex_find
+static void find_literals(regex *r) {
+  int nstates = r->nstates;
+  reach c = {
+      .r = r,
+      .seen = ecalloc(nstates, sizeof(bool)),
+      .stack = v_make(uint32_t),
+      .states = ecalloc(nstates, sizeof(uint32_t)),
+  };
+  uint32_t *from = ecalloc(nstates, sizeof(uint32_t));
+  char buf[MAX_LITERAL];
+
+  reach_clear(&c);
+  uint32_t start = 0;
+  epsilon_closure(&c, &start, 1);
+  for (int i = 0; i < c.n; i++) {
+    for (int ch = r->states[c.states[i]].lo; ch <= r->states[c.states[i]].hi; ch++)
+      r->first[ch] = true;
+  }
+  if (c.match) {
+    // Matches the empty string, so a match can start anywhere
+    memset(r->first, true, sizeof(r->first));
+  } else {
+    memcpy(from, c.states, c.n * sizeof(uint32_t));
+    r->prefix = copy_literal(r->a, buf, literal_from(&c, from, c.n, buf));
+  }
+
+  // A literal state is required if there is no way around it. The longest string starting at one is used.
+  int best = r->prefix.n;
+  for (int i = 0; !c.match && nstates <= MAX_LITERAL_STATES && i < nstates; i++) {
+    if (r->states[i].kind != STATE_CHAR || r->states[i].lo != r->states[i].hi)
+      continue;
+    reach_clear(&c);
+    if (reaches_end(&c, i))
+      continue;
+    from[0] = i;
+    int n = literal_from(&c, from, 1, buf);
+    if (n > best) {
+      best = n;
+      r->required = copy_literal(r->a, buf, n);
     }
   }
-  return (regex_match){0};
+
+  free(c.seen);
+  free(c.states);
+  free(from);
+  vec_destroy(&c.stack);
 }
 
-bool matches(const char *pattern, const char *string) {
-  regex *r = mk_regex(pattern);
-  if (r == NULL) {
+/* Fast paths
+ * Tokens of grammars are mostly punctuation, keywords or one character of a class. If every match of a regex is
+ * one of a few literals, or a single byte, matching it only takes memcmp, memmem or a lookup in `first`, which is
+ * cheaper than even starting the dfa.
+ */
+
+// Most literals a regex can be made of to be matched as literals
+#define MAX_FAST_LITERALS 8
+// States visited listing the literals, so regexes with loops or many paths are given up on quickly
+#define MAX_FAST_VISITS 256
+
+typedef struct {
+  const regex *r;
+  // The bytes of all literals found so far, and the length of each
+  vec bytes;
+  vec lengths;
+  int visits;
+} literal_list;
+
+// Add the literals matched by every path from state i, which follows the len bytes in buf, in order of priority.
+// Returns false if a path consumes a range of bytes or loops, or there are too many literals.
+static bool list_literals(literal_list *l, uint32_t i, char *buf, int len) {
+  const regex *r = l->r;
+  if (++l->visits > MAX_FAST_VISITS)
     return false;
+  if (r->states[i].kind == STATE_MATCH) {
+    vec_push_array(&l->bytes, len, buf);
+    vec_push(&l->lengths, &len);
+    return l->lengths.n <= MAX_FAST_LITERALS;
   }
-  bool result = regex_matches_strict(r, string);
-  destroy_regex(r);
-  return result;
+  if (r->states[i].kind == STATE_CHAR) {
+    if (r->states[i].lo != r->states[i].hi || len == MAX_LITERAL)
+      return false;
+    buf[len++] = r->states[i].lo;
+  }
+  for (uint32_t j = 0; j < ntransitions(r, i); j++) {
+    if (!list_literals(l, transitions(r, i)[j], buf, len))
+      return false;
+  }
+  return true;
+}
+
+// Check if every match of r is a single byte, so the consuming states reached from the start all lead straight
+// to the end
+static bool matches_one_byte(const regex *r) {
+  reach c = {
+      .r = r,
+      .seen = ecalloc(r->nstates, sizeof(bool)),
+      .stack = v_make(uint32_t),
+      .states = ecalloc(r->nstates, sizeof(uint32_t)),
+  };
+  uint32_t *from = ecalloc(r->nstates, sizeof(uint32_t));
+  reach_clear(&c);
+  uint32_t start = 0;
+  epsilon_closure(&c, &start, 1);
+  bool one_byte = !c.match && c.n > 0;
+  int n = c.n;
+  memcpy(from, c.states, n * sizeof(uint32_t));
+  for (int i = 0; one_byte && i < n; i++) {
+    reach_clear(&c);
+    epsilon_closure(&c, transitions(r, from[i]), ntransitions(r, from[i]));
+    one_byte = c.match && c.n == 0;
+  }
+  free(c.seen);
+  free(c.states);
+  free(from);
+  vec_destroy(&c.stack);
+  return one_byte;
 }
 
-static void _regex_first(nfa *d, char map[static UINT8_MAX]) {
-  if (d == NULL)
+// Check if r can be matched without the automaton. Sets are always matched with it.
+static void find_fast_path(regex *r) {
+  if (r->pattern)
+    return;
+  if (matches_one_byte(r)) {
+    r->single_byte = true;
     return;
-  if (d->accept == EPSILON) {
-    for (size_t i = 0; i < d->lst.n; i++) {
-      nfa *next = d->lst.arr[i];
-      _regex_first(next, map);
+  }
+  literal_list l = {.r = r, .bytes = v_make(char), .lengths = v_make(int)};
+  char buf[MAX_LITERAL];
+  if (list_literals(&l, 0, buf, 0)) {
+    r->literals = arena_alloc(r->a, l.lengths.n, sizeof(string_slice));
+    const char *bytes = copy_literal(r->a, l.bytes.array, l.bytes.n).str;
+    for (int i = 0; i < l.lengths.n; i++) {
+      r->literals[i] = (string_slice){.n = ((int *)l.lengths.array)[i], .str = bytes};
+      bytes += r->literals[i].n;
     }
-  } else {
-    for (int ch = d->accept; ch <= d->accept_end; ch++)
-      map[ch] = 1;
+    r->nliterals = l.lengths.n;
   }
+  vec_destroy(&l.bytes);
+  vec_destroy(&l.lengths);
 }
 
-void regex_first(regex *r, char map[static UINT8_MAX]) {
-  if (r && r->start) {
-    _regex_first(r->start, map);
+/* Matching
+ * The syntax has no backreferences or lookaround, so every regex can be simulated by tracking the set of nfa
+ * states that are waiting for input (Thompson / Pike VM). The set is kept in priority order: states are added by
+ * following transitions depth first in the order build_automaton added them, which is the order a backtracking
+ * matcher would try them in. When the end of the automaton is reached, all lower priority states are cut, so the
+ * last match seen while scanning is the leftmost-first match. Each state is added at most once per input
+ * character, so matching takes O(states * input) time.
+ *
+ * Searches add the start of the automaton at every position with the lowest priority, as if the regex was
+ * prefixed by a lazy .*, until a match is found. Threads from an earlier start take priority over later ones in
+ * the same state, so the result is the leftmost match, found in a single pass over the input.
+ *
+ * The lazy dfa caches each distinct set as a dfa state, and computes transitions between them the first time
+ * they are needed. If the cache grows beyond its budget, the dfa gives up and the sets are simulated directly.
+ * Transitions are indexed by byte class, so a dfa state only has a column for each set of bytes the regex tells
+ * apart.
+ *
+ * A compiled regex is never modified by matching, except for the dfa cache which is guarded by a lock.
+ * Everything else lives in a regex_scratch, so threads can share a regex as long as they use separate scratches.
+ */
+
+// Bytes of dfa states cached per automaton before falling back to simulating the nfa
+#define DFA_CACHE_SIZE (1 << 21)
+// Returned by dfa_exec if the cache budget was exceeded
+#define DFA_FAILED (-2)
+// Returned by the matchers if the match took more steps than the budget of its scratch
+#define MATCH_ABORTED (-3)
+// Most ranges of bytes a dfa state can loop on for runs of them to be skipped at once
+#define MAX_RUN_RANGES 4
+// Values of dstate.nruns before the bytes a state loops on are known, and if they can't be skipped at once
+#define RUNS_UNKNOWN 0
+#define RUNS_NONE (-1)
+
+enum match_kind {
+  // Stop at the first match in priority order
+  MATCH_FIRST,
+  // Track every alternative, for matches that must consume the whole input
+  MATCH_FULL,
+  // Like MATCH_FIRST, but a new match may start at every position until one is found
+  MATCH_SEARCH,
+  // Like MATCH_FIRST for every pattern of a set. A match only cuts states of its own pattern.
+  MATCH_SET,
+};
+
+typedef struct {
+  int n;
+  // Set if the end of the automaton was reached
+  bool match;
+  // Set if a match was found here or earlier, after which searches start no new threads
+  bool found;
+  // Set if every thread started at the current position, so no earlier match is possible
+  bool restart;
+  uint32_t *arr;
+  // Where each thread started, if tracked
+  long *starts;
+  // Where the thread that reached the end started
+  long match_start;
+  // For sets, the patterns that reached their end
+  int nmatched;
+  int *matched;
+  // When extracting captures, the capture slots of every thread
+  long *slots;
+} threadlist;
+
+// A pending state while following transitions for captures, or a slot to restore once everything reached through
+// a save state was added
+typedef struct {
+  uint32_t state;
+  // If not negative, the slot to restore instead
+  int slot;
+  long value;
+} capture_frame;
+
+struct regex_scratch {
+  // The regex being matched
+  const regex *r;
+  enum match_kind kind;
+  // Number of states the buffers below can hold
+  int cap;
+  // The generation in which each state was last added.
+  // Bumping the generation forgets all marks, so nothing needs to be reset between matches.
+  unsigned *marks;
+  unsigned gen;
+  // Pending states while following transitions
+  vec stack;
+  uint32_t *lists[2];
+  long *starts[2];
+  // For sets, the pattern of every state, and the generation in which each pattern reached its end
+  const int *pattern;
+  int pattern_cap;
+  unsigned *cut;
+  int *matched[2];
+  // Capture slots of every thread. path holds the slots of the path being followed, then those of the match.
+  size_t slots_cap;
+  long *slots[2];
+  long *path;
+  // Pending states and slots to restore while following transitions for captures
+  vec frames;
+  // Work done by the current match, and the number of steps it may take, or 0 for no limit
+  regex_stats stats;
+  long budget;
+};
+
+struct regex_totals {
+  pthread_mutex_t lock;
+  regex_stats stats;
+};
+
+regex_scratch *mk_regex_scratch(void) {
+  regex_scratch *s = ecalloc(1, sizeof(regex_scratch));
+  s->stack = v_make(uint32_t);
+  s->frames = v_make(capture_frame);
+  return s;
+}
+
+void destroy_regex_scratch(regex_scratch *s) {
+  if (s) {
+    free(s->marks);
+    free(s->lists[0]);
+    free(s->lists[1]);
+    free(s->starts[0]);
+    free(s->starts[1]);
+    free(s->cut);
+    free(s->matched[0]);
+    free(s->matched[1]);
+    free(s->slots[0]);
+    free(s->slots[1]);
+    free(s->path);
+    vec_destroy(&s->stack);
+    vec_destroy(&s->frames);
+    free(s);
+  }
+}
+
+// Prepare the scratch for a match against r
+static void scratch_init(regex_scratch *s, const regex *r, enum match_kind kind) {
+  s->r = r;
+  s->kind = kind;
+  s->pattern = NULL;
+  if (s->cap < r->nstates) {
+    s->marks = erealloc(s->marks, r->nstates, sizeof(unsigned));
+    memset(s->marks + s->cap, 0, (r->nstates - s->cap) * sizeof(unsigned));
+    for (int i = 0; i < 2; i++) {
+      s->lists[i] = erealloc(s->lists[i], r->nstates, sizeof(uint32_t));
+      s->starts[i] = erealloc(s->starts[i], r->nstates, sizeof(long));
+    }
+    s->cap = r->nstates;
+  }
+}
+
+// Prepare the scratch for a match against a set of n patterns
+static void scratch_init_set(regex_scratch *s, const regex_set *set) {
+  scratch_init(s, set->r, MATCH_SET);
+  s->pattern = set->r->pattern;
+  // The start state belongs to pattern n
+  int n = set->n + 1;
+  if (s->pattern_cap < n) {
+    s->cut = erealloc(s->cut, n, sizeof(unsigned));
+    memset(s->cut + s->pattern_cap, 0, (n - s->pattern_cap) * sizeof(unsigned));
+    for (int i = 0; i < 2; i++)
+      s->matched[i] = erealloc(s->matched[i], n, sizeof(int));
+    s->pattern_cap = n;
+  }
+}
+
+// Prepare the scratch for extracting the captures of r
+static void scratch_init_captures(regex_scratch *s, regex *r) {
+  scratch_init(s, r, MATCH_FIRST);
+  // Thread i of a list keeps its slots at slots[i * 2 * ngroups].
+  // Every group adds two states, so path is large enough as well.
+  size_t n = (size_t)s->cap * 2 * r->ngroups + 1;
+  if (s->slots_cap < n) {
+    for (int i = 0; i < 2; i++)
+      s->slots[i] = erealloc(s->slots[i], n, sizeof(long));
+    s->path = erealloc(s->path, n, sizeof(long));
+    s->slots_cap = n;
+  }
+}
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+static void mk_scratch_key(void) { pthread_key_create(&scratch_key, (void (*)(void *))destroy_regex_scratch); }
+
+// The scratch used by the functions that don't take one explicitly
+static regex_scratch *thread_scratch(void) {
+  static _Thread_local regex_scratch *scratch = NULL;
+  if (scratch == NULL) {
+    pthread_once(&scratch_once, mk_scratch_key);
+    scratch = mk_regex_scratch();
+    // Freed when the thread exits
+    pthread_setspecific(scratch_key, scratch);
+  }
+  return scratch;
+}
+
+regex_scratch *regex_thread_scratch(void) { return thread_scratch(); }
+
+const regex_stats *regex_scratch_stats(const regex_scratch *s) { return &s->stats; }
+
+void regex_scratch_budget(regex_scratch *s, long steps) { s->budget = steps; }
+
+// Steps the current match may still take before it is aborted
+static long steps_left(const regex_scratch *w) {
+  if (w->budget == 0)
+    return LONG_MAX;
+  long used = w->stats.dfa_bytes + w->stats.nfa_bytes + w->stats.nfa_states;
+  return used < w->budget ? w->budget - used : 0;
+}
+
+// Start counting the work of a match from zero
+static void begin_match(regex_scratch *w) { w->stats = (regex_stats){0}; }
+
+// Add the work of a match to the totals of r, if they are counted
+static void end_match(regex *r, regex_scratch *w, bool aborted) {
+  w->stats.aborted = aborted;
+  regex_totals *t = atomic_load_explicit(&r->totals, memory_order_acquire);
+  if (t == NULL)
+    return;
+  pthread_mutex_lock(&t->lock);
+  t->stats.dfa_bytes += w->stats.dfa_bytes;
+  t->stats.run_bytes += w->stats.run_bytes;
+  t->stats.dfa_states += w->stats.dfa_states;
+  t->stats.nfa_bytes += w->stats.nfa_bytes;
+  t->stats.nfa_states += w->stats.nfa_states;
+  t->stats.dfa_failures += w->stats.dfa_failures;
+  t->stats.aborted += w->stats.aborted;
+  pthread_mutex_unlock(&t->lock);
+}
+
+void regex_count_stats(regex *r) {
+  if (atomic_load(&r->totals))
+    return;
+  regex_totals *t = ecalloc(1, sizeof(regex_totals));
+  pthread_mutex_init(&t->lock, NULL);
+  regex_totals *expected = NULL;
+  // Another thread may have gotten here first
+  if (!atomic_compare_exchange_strong(&r->totals, &expected, t)) {
+    pthread_mutex_destroy(&t->lock);
+    free(t);
+  }
+}
+
+regex_stats regex_total_stats(regex *r) {
+  regex_stats stats = {0};
+  regex_totals *t = atomic_load_explicit(&r->totals, memory_order_acquire);
+  if (t) {
+    pthread_mutex_lock(&t->lock);
+    stats = t->stats;
+    pthread_mutex_unlock(&t->lock);
+  }
+  return stats;
+}
+
+void regex_print_stats(const regex_stats *s, FILE *f) {
+  fprintf(f, "dfa: %ld bytes, %ld skipped in runs, %ld states computed\n", s->dfa_bytes, s->run_bytes, s->dfa_states);
+  fprintf(f, "nfa: %ld bytes, %ld states visited\n", s->nfa_bytes, s->nfa_states);
+  fprintf(f, "%ld matches exceeded the dfa cache, %ld exceeded their budget\n", s->dfa_failures, s->aborted);
+}
+
+static void next_generation(regex_scratch *s) {
+  if (++s->gen == 0) {
+    memset(s->marks, 0, s->cap * sizeof(unsigned));
+    memset(s->cut, 0, s->pattern_cap * sizeof(unsigned));
+    s->gen = 1;
+  }
+}
+
+// Check if the pattern of state i already reached its end, so the state has a lower priority than the match.
+#define cut_state(w, i) ((w)->pattern && (w)->cut[(w)->pattern[i]] == (w)->gen)
+
+// Add the states in `from` and everything reachable from them without consuming anything to l.
+// Returns true if the end of the automaton was reached and the remaining states were cut.
+static bool add_states(regex_scratch *w, threadlist *l, const uint32_t *from, size_t n) {
+  const regex *r = w->r;
+  vec *stack = &w->stack;
+  stack->n = 0;
+  for (size_t i = n; i-- > 0;)
+    vec_push(stack, &from[i]);
+
+  while (stack->n) {
+    uint32_t i = *(uint32_t *)vec_pop(stack);
+    if (w->marks[i] == w->gen || cut_state(w, i))
+      continue;
+    w->marks[i] = w->gen;
+    w->stats.nfa_states++;
+    switch (r->states[i].kind) {
+      case STATE_CHAR:
+        l->arr[l->n++] = i;
+        break;
+      case STATE_MATCH:
+        l->match = true;
+        if (w->kind == MATCH_SET) {
+          // Only the rest of this pattern is cut
+          w->cut[w->pattern[i]] = w->gen;
+          l->matched[l->nmatched++] = w->pattern[i];
+        } else if (w->kind != MATCH_FULL) {
+          return true;
+        }
+        break;
+      default:
+        for (uint32_t j = ntransitions(r, i); j-- > 0;)
+          vec_push(stack, &transitions(r, i)[j]);
+        break;
+    }
   }
+  return false;
+}
+
+// Start a new thread at pos with the lowest priority, unless a match was already found.
+// States that older threads are waiting in are not added again, since the older thread would win anyway.
+static void seed(regex_scratch *w, threadlist *l, long pos) {
+  static const uint32_t start = 0;
+  int n = l->n;
+  l->restart = false;
+  if (l->found)
+    return;
+  add_states(w, l, &start, 1);
+  if (l->starts) {
+    for (int i = n; i < l->n; i++)
+      l->starts[i] = pos;
+    if (l->match)
+      l->match_start = pos;
+  }
+  l->found = l->match;
+  l->restart = w->kind == MATCH_SEARCH && n == 0;
+}
+
+static void start_states(regex_scratch *w, threadlist *l) {
+  next_generation(w);
+  l->n = 0;
+  l->nmatched = 0;
+  l->match = l->found = false;
+  seed(w, l, 0);
+}
+
+// Compute the states reached from cur by consuming ch
+static void step(regex_scratch *w, const threadlist *cur, u8 ch, threadlist *next) {
+  const regex *r = w->r;
+  next_generation(w);
+  next->n = 0;
+  next->nmatched = 0;
+  next->match = false;
+  next->found = cur->found;
+  next->restart = false;
+  for (int i = 0; i < cur->n; i++) {
+    uint32_t s = cur->arr[i];
+    if (ch < r->states[s].lo || ch > r->states[s].hi || cut_state(w, s))
+      continue;
+    int n = next->n;
+    bool cut = add_states(w, next, transitions(r, s), ntransitions(r, s));
+    if (next->starts) {
+      for (int j = n; j < next->n; j++)
+        next->starts[j] = cur->starts[i];
+      if (cut)
+        next->match_start = cur->starts[i];
+    }
+    if (cut)
+      break;
+  }
+  next->found |= next->match;
+}
+
+// Simulate the nfa on s.
+// Returns the end of the last match seen, -1 if there was no match, or MATCH_ABORTED.
+// When searching, the start of that match is stored in *start, and no match starts at or after limit.
+// For sets, ends[p] is set to the end of the last match of pattern p.
+static long pike_exec(regex_scratch *w, const u8 *s, long n, long limit, long *start, long *ends) {
+  bool search = w->kind == MATCH_SEARCH;
+  threadlist cur = {.arr = w->lists[0], .starts = search ? w->starts[0] : NULL, .matched = w->matched[0]};
+  threadlist next = {.arr = w->lists[1], .starts = search ? w->starts[1] : NULL, .matched = w->matched[1]};
+  start_states(w, &cur);
+  long last = -1;
+  for (long i = 0;; i++) {
+    if (cur.match) {
+      last = i;
+      if (search)
+        *start = cur.match_start;
+      for (int j = 0; j < cur.nmatched; j++)
+        ends[cur.matched[j]] = i;
+    }
+    if (i == n || cur.n == 0)
+      break;
+    if (steps_left(w) == 0)
+      return MATCH_ABORTED;
+    w->stats.nfa_bytes++;
+    step(w, &cur, s[i], &next);
+    if (search && i + 1 < limit)
+      seed(w, &next, i + 1);
+    threadlist tmp = cur;
+    cur = next;
+    next = tmp;
+  }
+  return last;
+}
+
+// Add the states in `from` and everything reachable from them to l like add_states with MATCH_FIRST, and give
+// every new thread the slots of the path that reached it first. w->path holds the slots of the current path.
+// If the end is reached, its slots are stored in match.
+static bool add_captures(regex_scratch *w, threadlist *l, const uint32_t *from, size_t n, long pos, long *match) {
+  const regex *r = w->r;
+  int nslots = 2 * r->ngroups;
+  long *path = w->path;
+  vec *stack = &w->frames;
+  stack->n = 0;
+  for (size_t i = n; i-- > 0;)
+    vec_push(stack, &(capture_frame){.state = from[i], .slot = -1});
+
+  while (stack->n) {
+    capture_frame f = *(capture_frame *)vec_pop(stack);
+    if (f.slot >= 0) {
+      path[f.slot] = f.value;
+      continue;
+    }
+    uint32_t i = f.state;
+    if (w->marks[i] == w->gen)
+      continue;
+    w->marks[i] = w->gen;
+    w->stats.nfa_states++;
+    switch (r->states[i].kind) {
+      case STATE_CHAR:
+        memcpy(l->slots + (size_t)l->n * nslots, path, nslots * sizeof(long));
+        l->arr[l->n++] = i;
+        break;
+      case STATE_MATCH:
+        l->match = true;
+        memcpy(match, path, nslots * sizeof(long));
+        return true;
+      case STATE_SAVE: {
+        // Once everything after the save state was added, the slot is restored for lower priority paths
+        int slot = r->states[i].slot;
+        vec_push(stack, &(capture_frame){.slot = slot, .value = path[slot]});
+        path[slot] = pos;
+        for (uint32_t j = ntransitions(r, i); j-- > 0;)
+          vec_push(stack, &(capture_frame){.state = transitions(r, i)[j], .slot = -1});
+      } break;
+      default:
+        for (uint32_t j = ntransitions(r, i); j-- > 0;)
+          vec_push(stack, &(capture_frame){.state = transitions(r, i)[j], .slot = -1});
+        break;
+    }
+  }
+  return false;
+}
+
+// Simulate the nfa on s like pike_exec with MATCH_FIRST, tracking the capture slots of every thread.
+// Returns the end of the match, or -1 if there is none. The slots of the match are stored in match.
+static long capture_exec(regex_scratch *w, const u8 *s, long n, long *match) {
+  static const uint32_t start = 0;
+  const regex *r = w->r;
+  int nslots = 2 * r->ngroups;
+  threadlist cur = {.arr = w->lists[0], .slots = w->slots[0]};
+  threadlist next = {.arr = w->lists[1], .slots = w->slots[1]};
+  next_generation(w);
+  for (int k = 0; k < nslots; k++)
+    w->path[k] = -1;
+  add_captures(w, &cur, &start, 1, 0, match);
+  long last = cur.match ? 0 : -1;
+  for (long i = 0; i < n && cur.n; i++) {
+    if (steps_left(w) == 0)
+      return MATCH_ABORTED;
+    w->stats.nfa_bytes++;
+    next_generation(w);
+    next.n = 0;
+    next.match = false;
+    for (int k = 0; k < cur.n; k++) {
+      uint32_t st = cur.arr[k];
+      if (s[i] < r->states[st].lo || s[i] > r->states[st].hi)
+        continue;
+      memcpy(w->path, cur.slots + (size_t)k * nslots, nslots * sizeof(long));
+      if (add_captures(w, &next, transitions(r, st), ntransitions(r, st), i + 1, match))
+        break;
+    }
+    if (next.match)
+      last = i + 1;
+    threadlist tmp = cur;
+    cur = next;
+    next = tmp;
+  }
+  return last;
+}
+
+typedef struct dstate dstate;
+struct dstate {
+  bool match;
+  bool found;
+  bool restart;
+  // Order in which the state was created
+  int id;
+  int n;
+  // nfa states waiting for input, in priority order
+  uint32_t *states;
+  // For sets, the patterns that reached their end
+  int nmatched;
+  int *matched;
+  // Ranges of bytes on which the state loops back to itself, such as the body of a string.
+  // nruns is written last while holding the dfa lock, after which the ranges are read without it.
+  _Atomic int nruns;
+  u8 run_lo[MAX_RUN_RANGES];
+  u8 run_hi[MAX_RUN_RANGES];
+  // Cached transitions for every byte class of the regex. NULL if not yet computed.
+  // Written while holding the dfa lock, but read without it.
+  _Atomic(dstate *) next[];
+};
+
+struct dfa {
+  arena *a;
+  pthread_mutex_t lock;
+  dstate *start;
+  // Byte classes of the regex, which index the transitions of each state
+  const u8 *classes;
+  int nclasses;
+  // Bytes used by cached states
+  size_t size;
+  // Set if the cache budget was exceeded
+  atomic_bool failed;
+  // Open addressing hash table of all states
+  dstate **table;
+  size_t table_cap;
+  size_t count;
+};
+
+static size_t hash_states(const threadlist *l) {
+  // FNV-1a
+  size_t h = 14695981039346656037ull;
+  for (int i = 0; i < l->n; i++) {
+    h ^= l->arr[i];
+    h *= 1099511628211ull;
+  }
+  for (int i = 0; i < l->nmatched; i++) {
+    h ^= l->matched[i];
+    h *= 1099511628211ull;
+  }
+  return h ^ l->match ^ (l->found << 1) ^ (l->restart << 2);
+}
+
+static bool same_states(const dstate *s, const threadlist *l) {
+  if (s->n != l->n || s->match != l->match || s->found != l->found || s->restart != l->restart)
+    return false;
+  if (s->nmatched != l->nmatched)
+    return false;
+  for (int i = 0; i < l->n; i++) {
+    if (s->states[i] != l->arr[i])
+      return false;
+  }
+  for (int i = 0; i < l->nmatched; i++) {
+    if (s->matched[i] != l->matched[i])
+      return false;
+  }
+  return true;
+}
+
+static void dfa_insert(dfa *d, dstate *s) {
+  threadlist l = {
+      .n = s->n,
+      .match = s->match,
+      .found = s->found,
+      .restart = s->restart,
+      .arr = s->states,
+      .nmatched = s->nmatched,
+      .matched = s->matched,
+  };
+  size_t mask = d->table_cap - 1;
+  size_t i = hash_states(&l) & mask;
+  while (d->table[i])
+    i = (i + 1) & mask;
+  d->table[i] = s;
+  d->count++;
+}
+
+static void dfa_grow_table(dfa *d) {
+  dstate **old = d->table;
+  size_t old_cap = d->table_cap;
+  d->table_cap = old_cap ? old_cap * 2 : 64;
+  d->table = ecalloc(d->table_cap, sizeof(dstate *));
+  d->count = 0;
+  for (size_t i = 0; i < old_cap; i++) {
+    if (old[i])
+      dfa_insert(d, old[i]);
+  }
+  free(old);
+}
+
+// Find the dfa state for l, creating it if it does not exist yet.
+// Returns NULL if the cache budget is exceeded.
+static dstate *dfa_state(dfa *d, const threadlist *l) {
+  if (d->table_cap) {
+    size_t mask = d->table_cap - 1;
+    for (size_t i = hash_states(l) & mask; d->table[i]; i = (i + 1) & mask) {
+      if (same_states(d->table[i], l))
+        return d->table[i];
+    }
+  }
+
+  size_t next_size = d->nclasses * sizeof(dstate *);
+  size_t size = sizeof(dstate) + next_size + l->n * sizeof(uint32_t) + l->nmatched * sizeof(int);
+  if (d->size + size > DFA_CACHE_SIZE) {
+    atomic_store(&d->failed, true);
+    return NULL;
+  }
+  d->size += size;
+
+  dstate *s = arena_alloc(d->a, 1, size);
+  memset(s, 0, size);
+  s->match = l->match;
+  s->found = l->found;
+  s->restart = l->restart;
+  s->n = l->n;
+  s->states = (uint32_t *)((char *)s->next + next_size);
+  memcpy(s->states, l->arr, l->n * sizeof(uint32_t));
+  s->nmatched = l->nmatched;
+  s->matched = (int *)(s->states + l->n);
+  // Only sets have matched patterns
+  if (l->nmatched)
+    memcpy(s->matched, l->matched, l->nmatched * sizeof(int));
+
+  if (2 * (d->count + 1) > d->table_cap)
+    dfa_grow_table(d);
+  s->id = d->count;
+  dfa_insert(d, s);
+  return s;
+}
+
+// Compute the nfa states reached from s on ch into next
+static void dfa_step(regex_scratch *w, const dstate *s, u8 ch, threadlist *next) {
+  threadlist cur = {.n = s->n, .match = s->match, .found = s->found, .arr = s->states};
+  *next = (threadlist){.arr = w->lists[0], .matched = w->matched[0]};
+  step(w, &cur, ch, next);
+  if (w->kind == MATCH_SEARCH)
+    seed(w, next, 0);
+}
+
+// Compute the transition from s on ch, and cache it
+static dstate *dfa_next(dfa *d, regex_scratch *w, dstate *s, u8 ch) {
+  pthread_mutex_lock(&d->lock);
+  // Another thread may have gotten here first
+  u8 class = d->classes[ch];
+  dstate *t = atomic_load_explicit(&s->next[class], memory_order_relaxed);
+  if (t == NULL && !d->failed) {
+    // States visited to compute dfa states are counted as the dfa states themselves
+    long visited = w->stats.nfa_states;
+    threadlist next;
+    dfa_step(w, s, ch, &next);
+    w->stats.nfa_states = visited;
+    t = dfa_state(d, &next);
+    w->stats.dfa_states++;
+    if (t)
+      atomic_store_explicit(&s->next[class], t, memory_order_release);
+  }
+  pthread_mutex_unlock(&d->lock);
+  return t;
+}
+
+// Find the ranges of bytes on which s loops back to itself.
+// Every byte class is stepped through without caching the states it leads to, so this never exceeds the budget.
+static void dfa_find_runs(dfa *d, regex_scratch *w, dstate *s) {
+  pthread_mutex_lock(&d->lock);
+  if (atomic_load_explicit(&s->nruns, memory_order_relaxed) == RUNS_UNKNOWN) {
+    long visited = w->stats.nfa_states;
+    bool loops[UINT8_MAX + 1];
+    int checked[UINT8_MAX + 1];
+    memset(checked, -1, sizeof(checked));
+    for (int b = 0; b <= UINT8_MAX; b++) {
+      u8 class = d->classes[b];
+      if (checked[class] < 0) {
+        dstate *t = atomic_load_explicit(&s->next[class], memory_order_relaxed);
+        threadlist next;
+        if (t == NULL)
+          dfa_step(w, s, b, &next);
+        checked[class] = t ? t == s : same_states(s, &next);
+      }
+      loops[b] = checked[class];
+    }
+    int n = 0;
+    for (int b = 0; b <= UINT8_MAX && n <= MAX_RUN_RANGES; b++) {
+      if (!loops[b] || (b > 0 && loops[b - 1]))
+        continue;
+      if (n < MAX_RUN_RANGES)
+        s->run_lo[n] = b;
+      while (b < UINT8_MAX && loops[b + 1])
+        b++;
+      if (n < MAX_RUN_RANGES)
+        s->run_hi[n] = b;
+      n++;
+    }
+    atomic_store_explicit(&s->nruns, n == 0 || n > MAX_RUN_RANGES ? RUNS_NONE : n, memory_order_release);
+    w->stats.nfa_states = visited;
+  }
+  pthread_mutex_unlock(&d->lock);
+}
+
+static bool in_run(const dstate *s, int nruns, u8 ch) {
+  for (int r = 0; r < nruns; r++) {
+    if (ch >= s->run_lo[r] && ch <= s->run_hi[r])
+      return true;
+  }
+  return false;
+}
+
+// Skip the bytes of str from i on which s loops back to itself, 16 or 32 at a time where the target supports it.
+// Returns the position of the first byte that leaves s, or n.
+static long dfa_skip_run(dfa *d, regex_scratch *w, dstate *s, const u8 *str, long i, long n) {
+  int nruns = atomic_load_explicit(&s->nruns, memory_order_acquire);
+  if (nruns == RUNS_UNKNOWN) {
+    dfa_find_runs(d, w, s);
+    nruns = atomic_load_explicit(&s->nruns, memory_order_acquire);
+  }
+  if (nruns == RUNS_NONE)
+    return i;
+  // A byte is in range r if subtracting run_lo[r] wraps it to at most run_hi[r] - run_lo[r]
+#ifdef __AVX2__
+  for (; i + 32 <= n; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(str + i));
+    __m256i in = _mm256_setzero_si256();
+    for (int r = 0; r < nruns; r++) {
+      __m256i off = _mm256_sub_epi8(x, _mm256_set1_epi8(s->run_lo[r]));
+      __m256i width = _mm256_set1_epi8(s->run_hi[r] - s->run_lo[r]);
+      in = _mm256_or_si256(in, _mm256_cmpeq_epi8(_mm256_min_epu8(off, width), off));
+    }
+    unsigned mask = _mm256_movemask_epi8(in);
+    if (mask != UINT32_MAX)
+      return i + __builtin_ctz(~mask);
+  }
+#endif
+#ifdef __SSE2__
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(str + i));
+    __m128i in = _mm_setzero_si128();
+    for (int r = 0; r < nruns; r++) {
+      __m128i off = _mm_sub_epi8(x, _mm_set1_epi8(s->run_lo[r]));
+      __m128i width = _mm_set1_epi8(s->run_hi[r] - s->run_lo[r]);
+      in = _mm_or_si128(in, _mm_cmpeq_epi8(_mm_min_epu8(off, width), off));
+    }
+    unsigned mask = _mm_movemask_epi8(in);
+    if (mask != UINT16_MAX)
+      return i + __builtin_ctz(~mask);
+  }
+#endif
+  while (i < n && in_run(s, nruns, str[i]))
+    i++;
+  return i;
+}
+
+static void destroy_dfa(dfa *d) {
+  if (d) {
+    free(d->table);
+    pthread_mutex_destroy(&d->lock);
+    destroy_arena(d->a);
+  }
+}
+
+static dfa *mk_dfa(regex_scratch *w) {
+  arena *a = mk_arena();
+  dfa *d = arena_alloc(a, 1, sizeof(dfa));
+  *d = (dfa){.a = a, .classes = w->r->classes.map, .nclasses = w->r->classes.n};
+  pthread_mutex_init(&d->lock, NULL);
+
+  threadlist start = {.arr = w->lists[0], .matched = w->matched[0]};
+  start_states(w, &start);
+  d->start = dfa_state(d, &start);
+  return d;
+}
+
+// Get the dfa for the kind of match w is prepared for, or NULL if it exceeded its cache budget
+static dfa *regex_dfa(regex *r, regex_scratch *w) {
+  static pthread_mutex_t create_lock = PTHREAD_MUTEX_INITIALIZER;
+  dfa *d = atomic_load_explicit(&r->dfa[w->kind], memory_order_acquire);
+  if (d == NULL) {
+    pthread_mutex_lock(&create_lock);
+    d = atomic_load_explicit(&r->dfa[w->kind], memory_order_relaxed);
+    if (d == NULL) {
+      d = mk_dfa(w);
+      atomic_store_explicit(&r->dfa[w->kind], d, memory_order_release);
+    }
+    pthread_mutex_unlock(&create_lock);
+  }
+  return d->failed ? NULL : d;
+}
+
+// Run the dfa from the beginning of s.
+// Returns the end of the last match seen, -1 if there was no match, DFA_FAILED or MATCH_ABORTED.
+// For sets, ends[p] is set to the end of the last match of pattern p.
+static long dfa_exec(dfa *d, regex_scratch *w, const u8 *s, long n, long *ends) {
+  dstate *st = d->start;
+  long last = -1;
+  // Only as much input as the budget allows is looked at
+  long left = steps_left(w);
+  long end = n < left ? n : left;
+  long i = 0;
+  for (;; i++) {
+    if (st->match) {
+      last = i;
+      for (int j = 0; j < st->nmatched; j++)
+        ends[st->matched[j]] = i;
+    }
+    if (i == end || st->n == 0)
+      break;
+    dstate *next = atomic_load_explicit(&st->next[d->classes[s[i]]], memory_order_acquire);
+    if (next == NULL && (next = dfa_next(d, w, st, s[i])) == NULL) {
+      w->stats.dfa_bytes += i;
+      return DFA_FAILED;
+    }
+    // Nothing changes until the state is left, besides where the match ends
+    if (next == st) {
+      long run = dfa_skip_run(d, w, st, s, i + 1, end);
+      w->stats.run_bytes += run - i - 1;
+      i = run - 1;
+    }
+    st = next;
+  }
+  w->stats.dfa_bytes += i;
+  return i < n && st->n ? MATCH_ABORTED : last;
+}
+
+// Compute the full dfa of the given kind, or NULL if it has more than max_states states
+static regex_table *build_table(regex *r, enum match_kind kind, int max_states) {
+  regex_scratch *w = mk_regex_scratch();
+  scratch_init(w, r, kind);
+  // A private dfa, so states are numbered from 0 in the order they are found
+  dfa *d = mk_dfa(w);
+  int nclasses = r->classes.n;
+  u8 first[UINT8_MAX + 1];
+  for (int b = UINT8_MAX; b >= 0; b--)
+    first[r->classes.map[b]] = b;
+
+  regex_table *t = NULL;
+  vec states = v_make(dstate *);
+  if (d->start)
+    vec_push(&states, &d->start);
+  for (int i = 0; i < states.n && states.n <= max_states; i++) {
+    dstate *s = *(dstate **)vec_nth(states, i);
+    for (int c = 0; c < nclasses && s->n; c++) {
+      dstate *next = dfa_next(d, w, s, first[c]);
+      if (next == NULL)
+        break;
+      if (next->id == states.n)
+        vec_push(&states, &next);
+    }
+  }
+
+  if (d->start && !d->failed && states.n <= max_states) {
+    t = ecalloc(1, sizeof(regex_table));
+    *t = (regex_table){
+        .nstates = states.n,
+        .classes = r->classes,
+        .next = ecalloc(states.n * nclasses, sizeof(int)),
+        .match = ecalloc(states.n, sizeof(bool)),
+        .done = ecalloc(states.n, sizeof(bool)),
+    };
+    v_foreach(dstate *, s, states) {
+      t->match[idx_s] = (*s)->match;
+      t->done[idx_s] = (*s)->n == 0;
+      for (int c = 0; c < nclasses && (*s)->n; c++)
+        t->next[idx_s * nclasses + c] = (*s)->next[c]->id;
+    }
+  }
+  vec_destroy(&states);
+  destroy_dfa(d);
+  destroy_regex_scratch(w);
+  return t;
+}
+
+regex_table *mk_regex_table(regex *r, int max_states) { return build_table(r, MATCH_FIRST, max_states); }
+
+void destroy_regex_table(regex_table *t) {
+  if (t) {
+    free(t->next);
+    free(t->match);
+    free(t->done);
+    free(t);
+  }
+}
+
+/* JIT
+ * The full dfa of a regex is translated to x86-64 code, with a block of code for every state that reads a byte
+ * and jumps to the block of the next state. The byte is compared against the ends of the ranges of bytes that
+ * lead to the same state, in a binary search, so no tables are read while matching.
+ * A compiled matcher is called as `long match(const u8 *s, long n, long i, long *stop)` and starts in the start
+ * state at offset i. It returns the end of the last match it saw once it reaches the end of the input or a state
+ * where nothing can change anymore, and stores where it stopped in *stop. Search matchers also return
+ * JIT_RESTART when they get back to the start state, so the caller can skip ahead to the next candidate.
+ */
+
+// Larger automata are left to the interpreter
+#define JIT_MAX_STATES 1024
+#define JIT_RESTART (-2)
+
+typedef long (*jit_fn)(const u8 *s, long n, long i, long *stop);
+
+struct jit_code {
+  void *code;
+  size_t size;
+  // Leftmost-first matches at the beginning of the input, and searches
+  jit_fn matches;
+  jit_fn search;
+};
+
+#ifdef REGEX_JIT
+typedef struct {
+  vec code;
+  // Offsets of the blocks of every state, and of the code that returns JIT_RESTART for the start state
+  long *blocks;
+  long restart;
+  // rel32 operands to fill in with the offset of a state's block once every block is placed
+  vec patches;
+} assembler;
+
+typedef struct {
+  long offset;
+  int state;
+} patch;
+
+// Ranges of bytes with the same next state
+typedef struct {
+  u8 hi;
+  int next;
+} byte_range;
+
+static void emit(assembler *a, int n, const u8 *bytes) { vec_push_array(&a->code, n, bytes); }
+
+static void emit32(assembler *a, int32_t value) {
+  u8 bytes[4] = {value, value >> 8, value >> 16, value >> 24};
+  emit(a, 4, bytes);
+}
+
+static void set32(assembler *a, long offset, int32_t value) {
+  u8 *p = (u8 *)a->code.array + offset;
+  for (int i = 0; i < 4; i++)
+    p[i] = value >> (8 * i);
+}
+
+// Emit a jump to the block of a state, and return the offset of its operand
+static long emit_jump(assembler *a, const u8 *opcode, int n, int state) {
+  emit(a, n, opcode);
+  long offset = a->code.n;
+  emit32(a, 0);
+  vec_push(&a->patches, &(patch){.offset = offset, .state = state});
+  return offset;
+}
+
+// Dispatch the byte in r9d to the next state of ranges[lo..hi]
+static void emit_dispatch(assembler *a, const byte_range *ranges, int lo, int hi) {
+  static const u8 jmp[] = {0xe9}, cmp_r9d[] = {0x41, 0x81, 0xf9}, ja[] = {0x0f, 0x87};
+  if (lo == hi) {
+    emit_jump(a, jmp, sizeof(jmp), ranges[lo].next);
+    return;
+  }
+  int mid = (lo + hi + 1) / 2;
+  emit(a, sizeof(cmp_r9d), cmp_r9d);
+  emit32(a, ranges[mid - 1].hi);
+  emit(a, sizeof(ja), ja);
+  long right = a->code.n;
+  emit32(a, 0);
+  emit_dispatch(a, ranges, lo, mid - 1);
+  set32(a, right, a->code.n - (right + 4));
+  emit_dispatch(a, ranges, mid, hi);
+}
+
+// Emit an SSE instruction on two xmm registers
+static void emit_sse(assembler *a, u8 opcode, int reg, int rm) {
+  u8 bytes[] = {0x66, 0x40 | (reg >= 8) << 2 | (rm >= 8), 0x0f, opcode, 0xc0 | (reg & 7) << 3 | (rm & 7)};
+  if (bytes[1] == 0x40)
+    emit(a, 1, bytes), emit(a, 3, bytes + 2);
+  else
+    emit(a, sizeof(bytes), bytes);
+}
+
+// Skip the run of bytes in the ranges a state loops on, 16 at a time, like dfa_skip_run. The ranges are tested by
+// subtracting their lower end and comparing with their width, using 16 byte constants placed before the code.
+// Falls through to the code that consumes the rest of the run byte by byte.
+static void emit_run(assembler *a, const byte_range *ranges, int n, int self) {
+  // lea r10, [r8 + 16]; cmp r10, rsi
+  static const u8 room[] = {0x4d, 0x8d, 0x50, 0x10, 0x49, 0x39, 0xf2};
+  static const u8 ja[] = {0x0f, 0x87}, jbe[] = {0x0f, 0x86}, jne[] = {0x0f, 0x85}, jmp[] = {0xe9};
+  // movdqu xmm0, [rdi + r8]; pxor xmm3, xmm3
+  static const u8 load[] = {0xf3, 0x42, 0x0f, 0x6f, 0x04, 0x07, 0x66, 0x0f, 0xef, 0xdb};
+  // pmovmskb r10d, xmm3; cmp r10d, 0xffff
+  static const u8 mask[] = {0x66, 0x44, 0x0f, 0xd7, 0xd3, 0x41, 0x81, 0xfa, 0xff, 0xff, 0x00, 0x00};
+  // add r8, 16
+  static const u8 advance[] = {0x49, 0x83, 0xc0, 0x10};
+  // not r10d; bsf r11d, r10d; add r8, r11
+  static const u8 partial[] = {0x41, 0xf7, 0xd2, 0x45, 0x0f, 0xbc, 0xda, 0x4d, 0x01, 0xd8};
+  enum { PSUBB = 0xf8, PMINUB = 0xda, PCMPEQB = 0x74, POR = 0xeb, MOVDQA = 0x6f };
+
+  // The lower ends and widths of the ranges, as constants before the block of the state
+  long constants[2 * MAX_RUN_RANGES];
+  int nruns = 0;
+  static const u8 nop = 0x90;
+  while (a->code.n % 16)
+    emit(a, 1, &nop);
+  for (int i = 0, lo = 0; i < n; lo = ranges[i++].hi + 1) {
+    if (ranges[i].next != self)
+      continue;
+    u8 bytes[32];
+    memset(bytes, lo, 16);
+    memset(bytes + 16, ranges[i].hi - lo, 16);
+    constants[nruns++] = a->code.n;
+    emit(a, sizeof(bytes), bytes);
+  }
+  a->blocks[self] = a->code.n;
+  emit(a, sizeof(room), room);
+  emit(a, sizeof(ja), ja);
+  long to_scalar = a->code.n;
+  emit32(a, 0);
+  for (int i = 0; i < nruns; i++) {
+    for (int j = 0; j < 2; j++) {
+      // movdqu xmm, [rip + constant]
+      int reg = 4 + 2 * i + j;
+      u8 bytes[] = {0xf3, 0x44, 0x0f, 0x6f, (reg & 7) << 3 | 5};
+      if (reg < 8)
+        emit(a, 1, bytes), emit(a, 3, bytes + 2);
+      else
+        emit(a, sizeof(bytes), bytes);
+      emit32(a, constants[i] + 16 * j - (a->code.n + 4));
+    }
+  }
+  long loop = a->code.n;
+  emit(a, sizeof(load), load);
+  for (int i = 0; i < nruns; i++) {
+    emit_sse(a, MOVDQA, 1, 0);
+    emit_sse(a, PSUBB, 1, 4 + 2 * i);
+    emit_sse(a, MOVDQA, 2, 1);
+    emit_sse(a, PMINUB, 2, 5 + 2 * i);
+    emit_sse(a, PCMPEQB, 1, 2);
+    emit_sse(a, POR, 3, 1);
+  }
+  emit(a, sizeof(mask), mask);
+  emit(a, sizeof(jne), jne);
+  long to_partial = a->code.n;
+  emit32(a, 0);
+  emit(a, sizeof(advance), advance);
+  emit(a, sizeof(room), room);
+  emit(a, sizeof(jbe), jbe);
+  emit32(a, loop - (a->code.n + 4));
+  emit(a, sizeof(jmp), jmp);
+  long to_scalar_after = a->code.n;
+  emit32(a, 0);
+  set32(a, to_partial, a->code.n - (to_partial + 4));
+  emit(a, sizeof(partial), partial);
+  set32(a, to_scalar, a->code.n - (to_scalar + 4));
+  set32(a, to_scalar_after, a->code.n - (to_scalar_after + 4));
+}
+
+// Translate the dfa in t. A search matcher returns when it gets back to the start state.
+static void emit_matcher(assembler *a, const regex_table *t, bool search) {
+  // mov rax, -1; mov r8, rdx; jmp start
+  static const u8 prologue[] = {0x48, 0xc7, 0xc0, 0xff, 0xff, 0xff, 0xff, 0x49, 0x89, 0xd0};
+  // mov [rcx], r8; ret
+  static const u8 exit[] = {0x4c, 0x89, 0x01, 0xc3};
+  // mov [rcx], r8; mov rax, JIT_RESTART; ret
+  static const u8 restart[] = {0x4c, 0x89, 0x01, 0x48, 0xc7, 0xc0, 0xfe, 0xff, 0xff, 0xff, 0xc3};
+  // mov rax, r8
+  static const u8 match[] = {0x4c, 0x89, 0xc0};
+  // cmp r8, rsi; jae exit
+  static const u8 at_end[] = {0x49, 0x39, 0xf0, 0x0f, 0x83};
+  // movzx r9d, byte [rdi + r8]; inc r8
+  static const u8 next_byte[] = {0x46, 0x0f, 0xb6, 0x0c, 0x07, 0x49, 0xff, 0xc0};
+  static const u8 jmp[] = {0xe9};
+
+  emit(a, sizeof(prologue), prologue);
+  long entry = a->code.n + 1;
+  emit(a, sizeof(jmp), jmp);
+  emit32(a, 0);
+  long exit_at = a->code.n;
+  emit(a, sizeof(exit), exit);
+  a->restart = -1;
+  if (search) {
+    a->restart = a->code.n;
+    emit(a, sizeof(restart), restart);
+  }
+  byte_range ranges[UINT8_MAX + 1];
+  int nclasses = t->classes.n;
+  for (int st = 0; st < t->nstates; st++) {
+    a->blocks[st] = a->code.n;
+    if (t->done[st]) {
+      if (t->match[st])
+        emit(a, sizeof(match), match);
+      emit(a, sizeof(jmp), jmp);
+      emit32(a, exit_at - (a->code.n + 4));
+      continue;
+    }
+    int n = 0, nself = 0;
+    for (int b = 0; b <= UINT8_MAX; b++) {
+      int next = t->next[st * nclasses + t->classes.map[b]];
+      if (n && ranges[n - 1].next == next)
+        ranges[n - 1].hi = b;
+      else
+        ranges[n++] = (byte_range){.hi = b, .next = next};
+    }
+    for (int i = 0; i < n; i++)
+      nself += ranges[i].next == st;
+    // The start state of a search hands control back instead of looping
+    if (nself && nself <= MAX_RUN_RANGES && !(search && st == 0))
+      emit_run(a, ranges, n, st);
+    if (t->match[st])
+      emit(a, sizeof(match), match);
+    emit(a, sizeof(at_end), at_end);
+    emit32(a, exit_at - (a->code.n + 4));
+    emit(a, sizeof(next_byte), next_byte);
+    emit_dispatch(a, ranges, 0, n - 1);
+  }
+  set32(a, entry, a->blocks[0] - (entry + 4));
+  v_foreach(patch, p, a->patches) {
+    // Getting back to the start state of a search hands control back to the caller
+    long target = search && p->state == 0 ? a->restart : a->blocks[p->state];
+    set32(a, p->offset, target - (p->offset + 4));
+  }
+  vec_clear(&a->patches);
+}
+
+// Compile r to native code, or return NULL if its automata are too large or code can't be made executable
+static jit_code *jit_compile(regex *r) {
+  regex_table *tables[] = {build_table(r, MATCH_FIRST, JIT_MAX_STATES), build_table(r, MATCH_SEARCH, JIT_MAX_STATES)};
+  jit_code *j = NULL;
+  if (tables[0] && tables[1]) {
+    assembler a = {.code = v_make(u8), .patches = v_make(patch)};
+    long offsets[LENGTH(tables)];
+    for (int i = 0; i < LENGTH(tables); i++) {
+      // Functions start 16 byte aligned
+      static const u8 nop = 0x90;
+      while (a.code.n % 16)
+        emit(&a, 1, &nop);
+      offsets[i] = a.code.n;
+      a.blocks = ecalloc(tables[i]->nstates, sizeof(long));
+      emit_matcher(&a, tables[i], i == 1);
+      free(a.blocks);
+    }
+    size_t size = a.code.n;
+    void *code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code != MAP_FAILED) {
+      memcpy(code, a.code.array, size);
+      if (mprotect(code, size, PROT_READ | PROT_EXEC) == 0) {
+        j = ecalloc(1, sizeof(jit_code));
+        *j = (jit_code){.code = code, .size = size};
+        // ISO C has no conversion from data to function pointers, but POSIX requires their representations to
+        // be the same for dlsym
+        void *matches = (char *)code + offsets[0], *search = (char *)code + offsets[1];
+        memcpy(&j->matches, &matches, sizeof(matches));
+        memcpy(&j->search, &search, sizeof(search));
+      } else {
+        munmap(code, size);
+      }
+    }
+    vec_destroy(&a.code);
+    vec_destroy(&a.patches);
+  }
+  for (int i = 0; i < LENGTH(tables); i++)
+    destroy_regex_table(tables[i]);
+  return j;
+}
+
+static void destroy_jit(jit_code *j) {
+  if (j) {
+    munmap(j->code, j->size);
+    free(j);
+  }
+}
+#else
+static jit_code *jit_compile(regex *r) {
+  (void)r;
+  return NULL;
+}
+
+static void destroy_jit(jit_code *j) { (void)j; }
+#endif
+
+bool regex_jit(regex *r) {
+  static pthread_mutex_t create_lock = PTHREAD_MUTEX_INITIALIZER;
+  // Sets report which patterns matched, which the compiled code doesn't track
+  if (r->pattern)
+    return false;
+  pthread_mutex_lock(&create_lock);
+  jit_code *j = atomic_load_explicit(&r->jit, memory_order_relaxed);
+  if (j == NULL && (j = jit_compile(r)))
+    atomic_store_explicit(&r->jit, j, memory_order_release);
+  pthread_mutex_unlock(&create_lock);
+  return j != NULL;
+}
+
+// The compiled code of r, if it was compiled and the match has no budget it could exceed
+static jit_code *usable_jit(regex *r, regex_scratch *w, long n) {
+  jit_code *j = atomic_load_explicit(&r->jit, memory_order_acquire);
+  return j && steps_left(w) >= n ? j : NULL;
+}
+
+// Run the dfa for the kind of match w is prepared for, or simulate the nfa if the dfa exceeds its cache budget
+static long exec(regex *r, regex_scratch *w, const char *s, long n) {
+  dfa *d = regex_dfa(r, w);
+  if (d) {
+    long end = dfa_exec(d, w, (const u8 *)s, n, NULL);
+    if (end != DFA_FAILED)
+      return end;
+  }
+  w->stats.dfa_failures++;
+  return pike_exec(w, (const u8 *)s, n, n, NULL, NULL);
+}
+
+// Find the first offset from i and before limit where a match of r can start, or -1 if there is none. The match
+// may run on up to n. `required` is the position of the last occurrence of the required literal that was found.
+static long next_candidate(const regex *r, const u8 *s, long i, long limit, long n, long *required) {
+  if (r->prefix.n) {
+    long end = limit + r->prefix.n - 1 < n ? limit + r->prefix.n - 1 : n;
+    const u8 *found = i < end ? memmem(s + i, end - i, r->prefix.str, r->prefix.n) : NULL;
+    if (found == NULL)
+      return -1;
+    i = found - s;
+  } else {
+    while (i < limit && !r->first[s[i]])
+      i++;
+    if (i >= limit)
+      return -1;
+  }
+  // A match starting at i has to contain the required literal after i
+  if (r->required.n && *required < i) {
+    const u8 *found = memmem(s + i, n - i, r->required.str, r->required.n);
+    if (found == NULL)
+      return -1;
+    *required = found - s;
+  }
+  return i;
+}
+
+// Check if a match of r looking at up to n bytes can skip the automaton. Its bytes still count towards the budget.
+static bool use_fast_path(const regex *r, regex_scratch *w, long n) {
+  return (r->single_byte || r->nliterals) && steps_left(w) >= n;
+}
+
+// Match a regex that use_fast_path accepted at the beginning of s, like first_match, or like full_match if
+// `longest` is set
+static long fast_match(const regex *r, regex_scratch *w, const u8 *s, long n, bool longest) {
+  long end = -1;
+  if (r->single_byte)
+    end = n && r->first[s[0]] ? 1 : -1;
+  for (int i = 0; i < r->nliterals && (longest || end < 0); i++) {
+    const string_slice *l = &r->literals[i];
+    if (l->n <= n && l->n > end && memcmp(s, l->str, l->n) == 0)
+      end = l->n;
+  }
+  w->stats.dfa_bytes += end < 0 ? 0 : end;
+  return end;
+}
+
+// Find the leftmost-first match of a regex that use_fast_path accepted, like search
+static long fast_search(const regex *r, regex_scratch *w, const u8 *s, long n, long limit, long *start) {
+  long end = -1;
+  *start = -1;
+  if (r->single_byte) {
+    long required = -1;
+    *start = next_candidate(r, s, 0, limit, n, &required);
+    end = *start < 0 ? -1 : *start + 1;
+  }
+  // Only an occurrence before the leftmost one so far can win over it
+  for (int i = 0; i < r->nliterals; i++) {
+    const string_slice *l = &r->literals[i];
+    long before = *start < 0 ? limit : *start;
+    if (before == 0)
+      continue;
+    const u8 *found = memmem(s, before - 1 + l->n < n ? before - 1 + l->n : n, l->str, l->n);
+    if (found) {
+      *start = found - s;
+      end = *start + l->n;
+    }
+  }
+  w->stats.dfa_bytes += end < 0 ? n : end;
+  return end;
+}
+
+// Find the length of the leftmost-first match at the beginning of s.
+// Returns -1 if there is no match, or MATCH_ABORTED.
+static long first_match(regex *r, regex_scratch *w, const char *s, long n) {
+  if (use_fast_path(r, w, n < MAX_LITERAL ? n : MAX_LITERAL))
+    return fast_match(r, w, (const u8 *)s, n, false);
+  jit_code *j = usable_jit(r, w, n);
+  if (j) {
+    long stop;
+    long end = j->matches((const u8 *)s, n, 0, &stop);
+    w->stats.dfa_bytes += stop;
+    return end;
+  }
+  scratch_init(w, r, MATCH_FIRST);
+  return exec(r, w, s, n);
+}
+
+// Find the longest prefix of s that matches r, so all of s matches if the result is n
+static long full_match(regex *r, regex_scratch *w, const char *s, long n) {
+  if (use_fast_path(r, w, n < MAX_LITERAL ? n : MAX_LITERAL))
+    return fast_match(r, w, (const u8 *)s, n, true);
+  scratch_init(w, r, MATCH_FULL);
+  return exec(r, w, s, n);
+}
+
+// The state of a search with the threads of s that starts no new ones, as if a match was found.
+// Returns NULL if the cache budget is exceeded.
+static dstate *dfa_stop_seeding(dfa *d, dstate *s) {
+  threadlist l = {.n = s->n, .match = s->match, .found = true, .arr = s->states};
+  pthread_mutex_lock(&d->lock);
+  dstate *t = d->failed ? NULL : dfa_state(d, &l);
+  pthread_mutex_unlock(&d->lock);
+  return t;
+}
+
+// Run the search dfa over s, skipping ahead to the next candidate whenever no thread is alive.
+// Returns the end of the leftmost-first match, -1 if there is none, DFA_FAILED or MATCH_ABORTED.
+// No match starts at or after limit, but one that started before may run past it.
+// *from is set to a position the match can't start before.
+static long dfa_search(regex *r, dfa *d, regex_scratch *w, const u8 *s, long n, long limit, long *from) {
+  dstate *st = d->start;
+  long required = -1;
+  long last = -1;
+  long left = steps_left(w);
+  long end = n < left ? n : left;
+  long i = 0;
+  for (;; i++) {
+    if (st == d->start) {
+      if ((i = next_candidate(r, s, i, limit < end ? limit : end, end, &required)) < 0) {
+        w->stats.dfa_bytes += end;
+        return end < n ? MATCH_ABORTED : -1;
+      }
+      *from = i;
+    }
+    // Only the matches already started may go on past the limit
+    if (i == limit && !st->found && (st = dfa_stop_seeding(d, st)) == NULL) {
+      w->stats.dfa_bytes += i;
+      return DFA_FAILED;
+    }
+    if (st->match)
+      last = i;
+    if (i == end || st->n == 0)
+      break;
+    dstate *next = atomic_load_explicit(&st->next[d->classes[s[i]]], memory_order_acquire);
+    if (next == NULL && (next = dfa_next(d, w, st, s[i])) == NULL) {
+      w->stats.dfa_bytes += i;
+      return DFA_FAILED;
+    }
+    // Nothing changes until the state is left, besides where the match ends
+    if (next == st) {
+      long run = dfa_skip_run(d, w, st, s, i + 1, st->found || limit > end ? end : limit);
+      w->stats.run_bytes += run - i - 1;
+      i = run - 1;
+    }
+    st = next;
+  }
+  w->stats.dfa_bytes += i;
+  return i < n && st->n ? MATCH_ABORTED : last;
+}
+
+// Search with compiled code, skipping ahead to the next candidate whenever the search gets back to the start state.
+// Returns the end of the leftmost-first match or -1, and sets *from like dfa_search.
+static long jit_search(regex *r, jit_code *j, regex_scratch *w, const u8 *s, long n, long limit, long *from) {
+  long required = -1;
+  for (long i = 0;;) {
+    if ((i = next_candidate(r, s, i, limit, n, &required)) < 0) {
+      w->stats.dfa_bytes += n;
+      return -1;
+    }
+    *from = i;
+    long stop, end = j->search(s, n, i, &stop);
+    if (end != JIT_RESTART) {
+      w->stats.dfa_bytes += stop;
+      return end;
+    }
+    i = stop;
+  }
+}
+
+// Build the automaton of the strings r matches reversed. State i of r becomes state i + 1, and takes the states
+// that lead to it as its transitions. State 0 starts from the match states of r, and reaching the start of r
+// leads to the new match state at the end.
+static regex *mk_reverse(const regex *r) {
+  arena *a = mk_arena();
+  regex *rev = arena_alloc(a, 1, sizeof(regex));
+  int n = r->nstates + 2;
+  *rev = (regex){.a = a, .refs = 1, .nstates = n, .classes = r->classes};
+  // Number of transitions of every state
+  uint32_t *count = ecalloc(n + 1, sizeof(uint32_t));
+  for (int i = 0; i < r->nstates; i++) {
+    count[0] += r->states[i].kind == STATE_MATCH;
+    for (uint32_t j = 0; j < ntransitions(r, i); j++)
+      count[transitions(r, i)[j] + 1]++;
+  }
+  count[1]++;
+  rev->states = arena_alloc(a, n + 1, sizeof(regex_state));
+  rev->edges = arena_alloc(a, r->states[r->nstates].out + count[0] + 1, sizeof(uint32_t));
+  uint32_t e = 0;
+  for (int i = 0; i < n; i++) {
+    rev->states[i] = (regex_state){.kind = STATE_SPLIT, .out = e};
+    e += count[i];
+  }
+  rev->states[n] = (regex_state){.out = e};
+  rev->states[n - 1].kind = STATE_MATCH;
+  // Fill in the transitions, using count as the number filled in so far
+  memset(count, 0, (n + 1) * sizeof(uint32_t));
+#define add_edge(from, to) rev->edges[rev->states[from].out + count[from]++] = (to)
+  for (int i = 0; i < r->nstates; i++) {
+    if (r->states[i].kind == STATE_CHAR)
+      rev->states[i + 1] = (regex_state){.kind = STATE_CHAR, .lo = r->states[i].lo, .hi = r->states[i].hi,
+                                         .out = rev->states[i + 1].out};
+    else if (r->states[i].kind == STATE_MATCH)
+      add_edge(0, i + 1);
+  }
+  add_edge(1, n - 1);
+  for (int i = 0; i < r->nstates; i++) {
+    for (uint32_t j = 0; j < ntransitions(r, i); j++)
+      add_edge(transitions(r, i)[j] + 1, i + 1);
+  }
+#undef add_edge
+  free(count);
+  return rev;
+}
+
+// Get the reversed automaton of r, building it if it doesn't exist yet
+static regex *regex_reverse(regex *r) {
+  static pthread_mutex_t create_lock = PTHREAD_MUTEX_INITIALIZER;
+  regex *rev = atomic_load_explicit(&r->reverse, memory_order_acquire);
+  if (rev == NULL) {
+    pthread_mutex_lock(&create_lock);
+    rev = atomic_load_explicit(&r->reverse, memory_order_relaxed);
+    if (rev == NULL) {
+      rev = mk_reverse(r);
+      atomic_store_explicit(&r->reverse, rev, memory_order_release);
+    }
+    pthread_mutex_unlock(&create_lock);
+  }
+  return rev;
+}
+
+// Run the dfa backwards from the end of s.
+// Returns the length of the last match seen, -1 if there was no match, DFA_FAILED or MATCH_ABORTED.
+static long dfa_exec_reverse(dfa *d, regex_scratch *w, const u8 *s, long n) {
+  dstate *st = d->start;
+  long last = -1;
+  long left = steps_left(w);
+  long end = n < left ? n : left;
+  long i = 0;
+  for (;; i++) {
+    if (st->match)
+      last = i;
+    if (i == end || st->n == 0)
+      break;
+    u8 ch = s[n - 1 - i];
+    dstate *next = atomic_load_explicit(&st->next[d->classes[ch]], memory_order_acquire);
+    if (next == NULL && (next = dfa_next(d, w, st, ch)) == NULL) {
+      w->stats.dfa_bytes += i;
+      return DFA_FAILED;
+    }
+    st = next;
+  }
+  w->stats.dfa_bytes += i;
+  return i < n && st->n ? MATCH_ABORTED : last;
+}
+
+// Find where the leftmost-first match that ends at end starts. No match starts before it, so it is the earliest
+// start from `from` on of a match that ends there, which the reversed automaton finds by scanning back from the end.
+// Returns the start, DFA_FAILED or MATCH_ABORTED.
+static long match_start(regex *r, regex_scratch *w, const char *s, long from, long end) {
+  regex *rev = regex_reverse(r);
+  scratch_init(w, rev, MATCH_FULL);
+  dfa *back = regex_dfa(rev, w);
+  long length = back ? dfa_exec_reverse(back, w, (const u8 *)s + from, end - from) : DFA_FAILED;
+  if (length == MATCH_ABORTED)
+    return length;
+  return length >= 0 ? end - length : DFA_FAILED;
+}
+
+// Find the leftmost-first match of r anywhere in s, scanning it once, if it starts before limit.
+// Returns the end of the match, -1 or MATCH_ABORTED, and stores the start of the match in *start.
+static long search(regex *r, regex_scratch *w, const char *s, long n, long limit, long *start) {
+  if (use_fast_path(r, w, n))
+    return fast_search(r, w, (const u8 *)s, n, limit, start);
+  scratch_init(w, r, MATCH_SEARCH);
+  // Compiled code can't stop starting matches at the limit
+  jit_code *j = limit < n ? NULL : usable_jit(r, w, n);
+  dfa *d = j ? NULL : regex_dfa(r, w);
+  long from = 0;
+  long end = j ? jit_search(r, j, w, (const u8 *)s, n, limit, &from)
+               : d ? dfa_search(r, d, w, (const u8 *)s, n, limit, &from) : DFA_FAILED;
+  if (end == -1 || end == MATCH_ABORTED)
+    return end;
+  // The dfa only knows where the match ends
+  if (end != DFA_FAILED) {
+    long begin = match_start(r, w, s, from, end);
+    if (begin == MATCH_ABORTED)
+      return begin;
+    if (begin != DFA_FAILED) {
+      *start = begin;
+      return end;
+    }
+  }
+  // Without a dfa, simulating the nfa from the last point where no older thread was alive finds the whole match
+  w->stats.dfa_failures++;
+  scratch_init(w, r, MATCH_SEARCH);
+  end = pike_exec(w, (const u8 *)s + from, (end >= 0 ? end : n) - from, limit - from, start, NULL);
+  *start += from;
+  return end < 0 ? end : end + from;
+}
+
+/* Leftmost-longest matches
+ * The leftmost-first match a search finds starts where the leftmost match of any kind starts. From there, the
+ * forward automaton keeping every thread finds the end of the longest match. Every pass is a dfa scan, so
+ * alternatives never need to be retried.
+ */
+
+// Find the longest match of r at the beginning of s.
+// Returns its length, -1 if there is none, or MATCH_ABORTED.
+static long longest_match(regex *r, regex_scratch *w, const char *s, long n) {
+  // Keeping every thread, the last match seen is the longest
+  scratch_init(w, r, MATCH_FULL);
+  return exec(r, w, s, n);
+}
+
+// Find the leftmost-longest match of r in s.
+// Returns the end of the match, -1 or MATCH_ABORTED, and stores the start of the match in *start.
+static long search_longest(regex *r, regex_scratch *w, const char *s, long n, long *start) {
+  scratch_init(w, r, MATCH_SEARCH);
+  dfa *d = regex_dfa(r, w);
+  long from = 0;
+  long end = d ? dfa_search(r, d, w, (const u8 *)s, n, n, &from) : DFA_FAILED;
+  if (end == -1 || end == MATCH_ABORTED)
+    return end;
+  long begin = end != DFA_FAILED ? match_start(r, w, s, from, end) : DFA_FAILED;
+  if (begin == MATCH_ABORTED)
+    return begin;
+  if (begin == DFA_FAILED) {
+    // Without a dfa, the start is found like for leftmost-first matches
+    w->stats.dfa_failures++;
+    scratch_init(w, r, MATCH_SEARCH);
+    long first = pike_exec(w, (const u8 *)s + from, (end >= 0 ? end : n) - from, n - from, &begin, NULL);
+    if (first < 0)
+      return first;
+    begin += from;
+  }
+  long length = longest_match(r, w, s + begin, n - begin);
+  if (length < 0)
+    return length;
+  *start = begin;
+  return begin + length;
+}
+
+// Match every pattern of the set at the beginning of s.
+// Returns MATCH_ABORTED if the budget was exceeded, and something else otherwise.
+static long set_match(regex_set *set, regex_scratch *w, const char *s, long n, long *ends) {
+  scratch_init_set(w, set);
+  for (int i = 0; i < set->n; i++)
+    ends[i] = -1;
+  dfa *d = regex_dfa(set->r, w);
+  long end = d ? dfa_exec(d, w, (const u8 *)s, n, ends) : DFA_FAILED;
+  if (end != DFA_FAILED)
+    return end;
+  w->stats.dfa_failures++;
+  for (int i = 0; i < set->n; i++)
+    ends[i] = -1;
+  return pike_exec(w, (const u8 *)s, n, n, NULL, ends);
+}
+
+void destroy_regex(regex *r) {
+  if (r && atomic_fetch_sub(&r->refs, 1) == 1) {
+    for (int i = 0; i < LENGTH(r->dfa); i++)
+      destroy_dfa(r->dfa[i]);
+    if (r->totals) {
+      pthread_mutex_destroy(&r->totals->lock);
+      free(r->totals);
+    }
+    destroy_regex(r->reverse);
+    destroy_jit(r->jit);
+    // The regex itself lives in the arena
+    destroy_arena(r->a);
+  }
+}
+
+// Compile the patterns into one automaton. For sets, the start state branches to each of them in order, and states
+// are grouped by the pattern they belong to. Otherwise n is 1. NULL patterns never match.
+static regex *compile(const string_slice *patterns, int n, bool set) {
+  arena *a = mk_arena();
+  regex *r = arena_alloc(a, 1, sizeof(regex));
+  *r = (regex){.a = a, .refs = 1};
+  // The graph is only needed until it is flattened
+  builder b = {.a = mk_arena()};
+  nfa **starts = ecalloc(n, sizeof(nfa *));
+  int *first_id = ecalloc(n + 1, sizeof(int));
+  bool valid = true;
+  for (int i = 0; i < n && valid; i++) {
+    first_id[i] = b.nstates;
+    if (patterns[i].str == NULL)
+      continue;
+    char *copy = arena_alloc(a, patterns[i].n + 1, 1);
+    memcpy(copy, patterns[i].str, patterns[i].n);
+    b.ctx = (parse_context){.view = {.n = patterns[i].n, .str = copy}};
+    starts[i] = build_automaton(&b, 0);
+    if (!finished(&b.ctx)) {
+      debug("Invalid regex '%S'", patterns[i]);
+      valid = false;
+    }
+  }
+  first_id[n] = b.nstates;
+
+  if (valid && !set) {
+    r->ctx = b.ctx;
+    r->ngroups = b.ngroups;
+    flatten(r, starts[0], b.nstates, NULL, 1);
+  } else if (valid) {
+    nfa *start = mk_state(&b, EPSILON);
+    for (int i = 0; i < n; i++) {
+      if (starts[i])
+        add_transition(&b, start, starts[i]);
+    }
+    // Without any pattern, loop forever instead of reaching the end
+    if (start->lst.n == 0)
+      add_transition(&b, start, start);
+    int *group = ecalloc(b.nstates, sizeof(int));
+    for (int i = 0; i < n; i++) {
+      for (int id = first_id[i]; id < first_id[i + 1]; id++)
+        group[id] = i;
+    }
+    // The start state belongs to no pattern
+    group[start->id] = n;
+    flatten(r, start, b.nstates, group, n + 1);
+    free(group);
+  }
+  destroy_arena(b.a);
+  free(starts);
+  free(first_id);
+  if (!valid) {
+    destroy_regex(r);
+    return NULL;
+  }
+  optimize(r);
+  byte_classes_add(&r->classes, r);
+  return r;
+}
+
+/* Cache
+ * Compiled regexes are shared by the text they were compiled from, so building the same scanner or grammar again
+ * only costs a lookup. The cache holds a reference to the most recently used regexes. Every text hashes to a bucket
+ * of a few entries, and the least recently used entry of the bucket makes room for new ones.
+ */
+
+#define CACHE_BUCKETS 64
+#define CACHE_WAYS 4
+
+typedef struct {
+  regex *r;
+  size_t hash;
+  // Value of the clock when the entry was last used
+  uint64_t used;
+} cache_entry;
+
+static struct {
+  pthread_mutex_t lock;
+  uint64_t clock;
+  cache_entry entries[CACHE_BUCKETS][CACHE_WAYS];
+} cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static size_t hash_source(string_slice source, bool set) {
+  // FNV-1a
+  size_t h = 14695981039346656037ull;
+  for (int i = 0; i < source.n; i++) {
+    h ^= (u8)source.str[i];
+    h *= 1099511628211ull;
+  }
+  return h ^ set;
+}
+
+static bool same_source(const regex *r, string_slice source, bool set) {
+  return (r->pattern != NULL) == set && r->source.n == source.n &&
+         (source.n == 0 || memcmp(r->source.str, source.str, source.n) == 0);
+}
+
+// Take a reference to a cached regex compiled from source, or return NULL
+static regex *cache_get(string_slice source, bool set, size_t hash) {
+  cache_entry *bucket = cache.entries[hash % CACHE_BUCKETS];
+  regex *r = NULL;
+  pthread_mutex_lock(&cache.lock);
+  for (int i = 0; i < CACHE_WAYS && r == NULL; i++) {
+    if (bucket[i].r && bucket[i].hash == hash && same_source(bucket[i].r, source, set)) {
+      r = bucket[i].r;
+      atomic_fetch_add(&r->refs, 1);
+      bucket[i].used = ++cache.clock;
+    }
+  }
+  pthread_mutex_unlock(&cache.lock);
+  return r;
+}
+
+static void register_cache_clear(void) { atexit(regex_cache_clear); }
+
+// Keep a reference to r in the cache, in place of the least recently used entry of its bucket
+static void cache_put(regex *r, bool set, size_t hash) {
+  pthread_once(&cache_once, register_cache_clear);
+  cache_entry *bucket = cache.entries[hash % CACHE_BUCKETS];
+  pthread_mutex_lock(&cache.lock);
+  cache_entry *victim = &bucket[0];
+  for (int i = 0; i < CACHE_WAYS; i++) {
+    // Another thread may have compiled the same text in the meantime
+    if (bucket[i].r == NULL || (bucket[i].hash == hash && same_source(bucket[i].r, r->source, set))) {
+      victim = &bucket[i];
+      break;
+    }
+    if (bucket[i].used < victim->used)
+      victim = &bucket[i];
+  }
+  regex *evicted = victim->r;
+  atomic_fetch_add(&r->refs, 1);
+  *victim = (cache_entry){.r = r, .hash = hash, .used = ++cache.clock};
+  pthread_mutex_unlock(&cache.lock);
+  destroy_regex(evicted);
+}
+
+void regex_cache_clear(void) {
+  regex *evicted[CACHE_BUCKETS * CACHE_WAYS];
+  pthread_mutex_lock(&cache.lock);
+  for (int i = 0; i < CACHE_BUCKETS; i++) {
+    for (int j = 0; j < CACHE_WAYS; j++) {
+      evicted[i * CACHE_WAYS + j] = cache.entries[i][j].r;
+      cache.entries[i][j] = (cache_entry){0};
+    }
+  }
+  pthread_mutex_unlock(&cache.lock);
+  for (int i = 0; i < LENGTH(evicted); i++)
+    destroy_regex(evicted[i]);
+}
+
+/* Images
+ * An image is a header followed by saved regexes. A saved regex is a saved_regex followed by its parts: the
+ * states, the edges, the pattern of every state for sets, and the bytes of the source and the literals. Parts are
+ * located by their offset from the start of their regex and aligned to 8 bytes, so an image can be mapped anywhere
+ * and its automata used in place. Only the regex struct of a loaded regex is allocated.
+ */
+
+#define IMAGE_MAGIC "REGEXIMG"
+#define IMAGE_VERSION 1
+#define IMAGE_ALIGN 8
+// Written in the byte order of the machine, which loading checks
+#define IMAGE_BYTE_ORDER 0x01020304u
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t state_size;
+  // Number of regexes in the image
+  uint32_t count;
+} image_header;
+
+typedef struct {
+  // Bytes the regex takes in the image, including its parts
+  uint64_t size;
+  uint32_t nstates;
+  uint32_t nedges;
+  uint32_t ngroups;
+  uint32_t set;
+  // Offsets of the parts, and the lengths of the strings
+  uint32_t states, edges, pattern;
+  uint32_t source, source_n;
+  uint32_t prefix, prefix_n;
+  uint32_t required, required_n;
+  uint32_t nclasses;
+  u8 classes[UINT8_MAX + 1];
+  u8 first[UINT8_MAX + 1];
+} saved_regex;
+
+// Append n bytes to out, padded to the alignment of the image, and return their offset from start
+static uint32_t put_part(vec *out, int start, const void *data, size_t n) {
+  uint32_t offset = out->n - start;
+  vec_push_array(out, n, data);
+  static const char padding[IMAGE_ALIGN];
+  vec_push_array(out, (IMAGE_ALIGN - n % IMAGE_ALIGN) % IMAGE_ALIGN, padding);
+  return offset;
+}
+
+bool regex_save(regex **regexes, int n, FILE *f) {
+  image_header header = {.magic = IMAGE_MAGIC, .version = IMAGE_VERSION, .byte_order = IMAGE_BYTE_ORDER,
+                         .state_size = sizeof(regex_state), .count = n};
+  vec out = v_make(char);
+  put_part(&out, 0, &header, sizeof(header));
+  for (int i = 0; i < n; i++) {
+    regex *r = regexes[i];
+    int start = out.n;
+    // Padding is written as well, so it is cleared rather than left undefined
+    saved_regex saved;
+    memset(&saved, 0, sizeof(saved));
+    saved.nstates = r->nstates;
+    saved.nedges = r->states[r->nstates].out;
+    saved.ngroups = r->ngroups;
+    saved.set = r->pattern != NULL;
+    saved.nclasses = r->classes.n;
+    memcpy(saved.classes, r->classes.map, sizeof(saved.classes));
+    for (int c = 0; c <= UINT8_MAX; c++)
+      saved.first[c] = r->first[c];
+    put_part(&out, start, &saved, sizeof(saved));
+    regex_state *states = ecalloc(r->nstates + 1, sizeof(regex_state));
+    for (int j = 0; j <= r->nstates; j++) {
+      states[j].kind = r->states[j].kind;
+      states[j].slot = r->states[j].slot;
+      states[j].out = r->states[j].out;
+    }
+    saved.states = put_part(&out, start, states, (r->nstates + 1) * sizeof(regex_state));
+    free(states);
+    saved.edges = put_part(&out, start, r->edges, saved.nedges * sizeof(uint32_t));
+    if (saved.set)
+      saved.pattern = put_part(&out, start, r->pattern, r->nstates * sizeof(int));
+    saved.source_n = r->source.n;
+    saved.source = put_part(&out, start, r->source.str, r->source.n);
+    saved.prefix_n = r->prefix.n;
+    saved.prefix = put_part(&out, start, r->prefix.str, r->prefix.n);
+    saved.required_n = r->required.n;
+    saved.required = put_part(&out, start, r->required.str, r->required.n);
+    saved.size = out.n - start;
+    memcpy((char *)out.array + start, &saved, sizeof(saved));
+  }
+  bool ok = fwrite(out.array, 1, out.n, f) == (size_t)out.n;
+  vec_destroy(&out);
+  return ok;
+}
+
+bool regex_save_cache(FILE *f) {
+  regex *regexes[CACHE_BUCKETS * CACHE_WAYS];
+  int n = 0;
+  pthread_mutex_lock(&cache.lock);
+  for (int i = 0; i < CACHE_BUCKETS; i++) {
+    for (int j = 0; j < CACHE_WAYS; j++) {
+      if ((regexes[n] = cache.entries[i][j].r))
+        atomic_fetch_add(&regexes[n++]->refs, 1);
+    }
+  }
+  pthread_mutex_unlock(&cache.lock);
+  bool ok = regex_save(regexes, n, f);
+  for (int i = 0; i < n; i++)
+    destroy_regex(regexes[i]);
+  return ok;
+}
+
+// Count the patterns in the source of a set, which are each prefixed by their length, or -1 if it is malformed
+static int count_patterns(string_slice source) {
+  int count = 0;
+  for (int i = 0; i < source.n; count++) {
+    long length = 0;
+    bool negative = i < source.n && source.str[i] == '-';
+    i += negative;
+    for (; i < source.n && source.str[i] >= '0' && source.str[i] <= '9' && length <= source.n; i++)
+      length = length * 10 + source.str[i] - '0';
+    if (i == source.n || source.str[i] != ':' || (negative && length != 1))
+      return -1;
+    i += 1 + (negative ? 0 : length);
+    if (i > source.n)
+      return -1;
+  }
+  return count;
+}
+
+// Check that a part of n elements of the given size lies within a saved regex and is aligned
+static bool part_valid(const saved_regex *saved, uint32_t offset, uint64_t n, size_t size) {
+  return offset % IMAGE_ALIGN == 0 && offset >= sizeof(saved_regex) && offset <= saved->size &&
+         n <= (saved->size - offset) / size;
+}
+
+// Check that a saved regex is well formed, so matching it can't read outside of it
+static bool saved_valid(const saved_regex *saved) {
+  if (saved->nstates == 0 || saved->nstates > INT_MAX / 2 || saved->ngroups > MAX_GROUPS || saved->nclasses == 0 ||
+      saved->nclasses > UINT8_MAX + 1 || !part_valid(saved, saved->states, saved->nstates + 1, sizeof(regex_state)) ||
+      !part_valid(saved, saved->edges, saved->nedges, sizeof(uint32_t)) ||
+      (saved->set && !part_valid(saved, saved->pattern, saved->nstates, sizeof(int))) ||
+      !part_valid(saved, saved->source, saved->source_n, 1) || !part_valid(saved, saved->prefix, saved->prefix_n, 1) ||
+      !part_valid(saved, saved->required, saved->required_n, 1))
+    return false;
+  const char *base = (const char *)saved;
+  for (int c = 0; c <= UINT8_MAX; c++) {
+    if (saved->classes[c] >= saved->nclasses || saved->first[c] > 1)
+      return false;
+  }
+  const regex_state *states = (const regex_state *)(base + saved->states);
+  const uint32_t *edges = (const uint32_t *)(base + saved->edges);
+  if (states[0].out != 0 || states[saved->nstates].out != saved->nedges)
+    return false;
+  for (uint32_t i = 0; i < saved->nstates; i++) {
+    // Sets don't extract captures, so their slots are never used
+    if (states[i].kind > STATE_MATCH || states[i + 1].out < states[i].out ||
+        (states[i].kind == STATE_SAVE && !saved->set && states[i].slot >= 2 * saved->ngroups))
+      return false;
+  }
+  for (uint32_t i = 0; i < saved->nedges; i++) {
+    if (edges[i] >= saved->nstates)
+      return false;
+  }
+  if (saved->set) {
+    int count = count_patterns((string_slice){.n = saved->source_n, .str = base + saved->source});
+    const int *pattern = (const int *)(base + saved->pattern);
+    for (uint32_t i = 0; i < saved->nstates; i++) {
+      if (count < 0 || pattern[i] < 0 || pattern[i] > count)
+        return false;
+    }
+  }
+  return true;
+}
+
+int regex_load_cache(const void *data, size_t n) {
+  const char *image = data;
+  const image_header *header = data;
+  if ((uintptr_t)data % IMAGE_ALIGN || n < sizeof(image_header) || memcmp(header->magic, IMAGE_MAGIC, 8) ||
+      header->version != IMAGE_VERSION || header->byte_order != IMAGE_BYTE_ORDER ||
+      header->state_size != sizeof(regex_state))
+    return -1;
+  // Check every regex before loading any, so a bad image loads nothing
+  size_t pos = sizeof(image_header);
+  for (uint32_t i = 0; i < header->count; i++) {
+    const saved_regex *saved = (const saved_regex *)(image + pos);
+    if (n - pos < sizeof(saved_regex) || saved->size > n - pos || saved->size % IMAGE_ALIGN || !saved_valid(saved))
+      return -1;
+    pos += saved->size;
+  }
+  pos = sizeof(image_header);
+  for (uint32_t i = 0; i < header->count; i++) {
+    const saved_regex *saved = (const saved_regex *)(image + pos);
+    const char *base = image + pos;
+    pos += saved->size;
+    arena *a = mk_arena();
+    regex *r = arena_alloc(a, 1, sizeof(regex));
+    *r = (regex){
+        .a = a,
+        .refs = 1,
+        .source = {.n = saved->source_n, .str = base + saved->source},
+        .states = (regex_state *)(base + saved->states),
+        .edges = (uint32_t *)(base + saved->edges),
+        .nstates = saved->nstates,
+        .ngroups = saved->ngroups,
+        .pattern = saved->set ? (int *)(base + saved->pattern) : NULL,
+        .classes = {.n = saved->nclasses},
+        .prefix = {.n = saved->prefix_n, .str = base + saved->prefix},
+        .required = {.n = saved->required_n, .str = base + saved->required},
+    };
+    r->ctx = (parse_context){.view = r->source, .c = r->source.n};
+    memcpy(r->classes.map, saved->classes, sizeof(saved->classes));
+    for (int c = 0; c <= UINT8_MAX; c++)
+      r->first[c] = saved->first[c];
+    find_fast_path(r);
+    cache_put(r, saved->set, hash_source(r->source, saved->set));
+    destroy_regex(r);
+  }
+  return header->count;
+}
+
+regex *mk_regex_from_slice(string_slice slice) {
+  if (slice.str == NULL) {
+    error("NULL string");
+    return NULL;
+  }
+  size_t hash = hash_source(slice, false);
+  regex *r = cache_get(slice, false, hash);
+  if (r)
+    return r;
+  r = compile(&slice, 1, false);
+  if (r) {
+    r->source = copy_literal(r->a, slice.str, slice.n);
+    find_literals(r);
+    find_fast_path(r);
+    cache_put(r, false, hash);
+  }
+  return r;
+}
+
+regex_set *mk_regex_set(const char **patterns, int n) {
+  string_slice *slices = ecalloc(n, sizeof(string_slice));
+  vec source = v_make(char);
+  for (int i = 0; i < n; i++) {
+    slices[i] = patterns[i] ? (string_slice){.n = strlen(patterns[i]), .str = patterns[i]} : (string_slice){0};
+    char length[24];
+    vec_push_array(&source, snprintf(length, sizeof(length), "%d:", patterns[i] ? slices[i].n : -1), length);
+    vec_push_array(&source, slices[i].n, slices[i].str);
+  }
+  string_slice key = {.n = source.n, .str = source.array};
+  size_t hash = hash_source(key, true);
+  regex *r = cache_get(key, true, hash);
+  if (r == NULL && (r = compile(slices, n, true))) {
+    r->source = copy_literal(r->a, key.str, key.n);
+    cache_put(r, true, hash);
+  }
+  free(slices);
+  vec_destroy(&source);
+  if (r == NULL)
+    return NULL;
+  regex_set *set = ecalloc(1, sizeof(regex_set));
+  *set = (regex_set){.r = r, .n = n};
+  return set;
+}
+
+void destroy_regex_set(regex_set *s) {
+  if (s) {
+    destroy_regex(s->r);
+    free(s);
+  }
+}
+
+regex *mk_regex(const char *pattern) {
+  string_slice s = {.n = strlen(pattern), .str = pattern};
+  regex *r = mk_regex_from_slice(s);
+  return r;
+}
+
+regex_match regex_pos(regex *r, const char *string, int len) {
+  regex_match result = {0};
+  if (!string)
+    return result;
+  if (len <= 0)
+    len = strlen(string);
+  regex_scratch *w = thread_scratch();
+  begin_match(w);
+  long end = first_match(r, w, string, len);
+  end_match(r, w, end == MATCH_ABORTED);
+  if (end >= 0) {
+    result.match = true;
+    result.matched = (string_slice){.n = end, .str = string};
+  }
+  result.aborted = end == MATCH_ABORTED;
+  return result;
+}
+
+regex_match regex_matches_r(regex *r, match_context *ctx, regex_scratch *scratch) {
+  if (r == NULL)
+    error("NULL regex");
+  int pos = ctx->c;
+  begin_match(scratch);
+  long end = first_match(r, scratch, ctx->view.str + pos, ctx->view.n - pos);
+  end_match(r, scratch, end == MATCH_ABORTED);
+  if (end >= 0) {
+    regex_match result = {0};
+    result.match = true;
+    result.matched = (string_slice){.n = end, .str = ctx->view.str + pos};
+    ctx->c = pos + end;
+    return result;
+  } else {
+    regex_match no_match = {.aborted = end == MATCH_ABORTED};
+    return no_match;
+  }
+}
+
+regex_match regex_matches(regex *r, match_context *ctx) { return regex_matches_r(r, ctx, thread_scratch()); }
+
+bool regex_matches_strict(regex *r, const char *string) {
+  regex_scratch *w = thread_scratch();
+  long n = strlen(string);
+  begin_match(w);
+  long end = full_match(r, w, string, n);
+  end_match(r, w, end == MATCH_ABORTED);
+  return end == n;
+}
+
+// Find the first match in s, as part of a match that began already
+static regex_match find(regex *r, string_slice s, regex_scratch *scratch) {
+  long start, end = s.n ? search(r, scratch, s.str, s.n, s.n, &start) : -1;
+  if (end < 0)
+    return (regex_match){.aborted = end == MATCH_ABORTED};
+  return (regex_match){
+      .matched = {.n = end - start, .str = s.str + start},
+      .match = true,
+  };
+}
+
+regex_match regex_find_slice_r(regex *r, string_slice s, regex_scratch *scratch) {
+  begin_match(scratch);
+  regex_match m = find(r, s, scratch);
+  end_match(r, scratch, m.aborted);
+  return m;
+}
+
+regex_match regex_find_slice(regex *r, string_slice s) { return regex_find_slice_r(r, s, thread_scratch()); }
+
+regex_iter mk_regex_iter_r(regex *r, string_slice input, regex_scratch *scratch) {
+  return (regex_iter){.r = r, .scratch = scratch, .input = input};
+}
+
+regex_iter mk_regex_iter(regex *r, string_slice input) { return mk_regex_iter_r(r, input, thread_scratch()); }
+
+regex_match regex_iter_next(regex_iter *it) {
+  string_slice rest = {.n = it->input.n - it->pos, .str = it->input.str + it->pos};
+  regex_match m = regex_find_slice_r(it->r, rest, it->scratch);
+  if (!m.match) {
+    // Nothing is left to search
+    it->pos = it->input.n;
+    return m;
+  }
+  long end = m.matched.str + m.matched.n - it->input.str;
+  it->pos = m.matched.n ? end : end + 1;
+  return m;
+}
+
+/* Parallel search
+ * A pool of threads searches the chunks of some input, each thread with a scratch of its own, while the calling
+ * thread consumes the chunks in order as soon as they are done.
+ *
+ * regex_find_parallel splits a buffer into chunks, and each chunk lists the matches an iteration from its beginning
+ * finds until the end of the chunk. A match of the chunk before may end past that beginning, so the iteration over
+ * the whole buffer comes to the chunk at another position. A search finds the first match that starts at or after
+ * where it starts, so it finds the same match from anywhere between the start of a listed search and the start of
+ * its match. Only from inside a listed match does the chunk have to be searched again, until the iteration meets a
+ * listed search. Searches of a chunk start no new match past its end, so only matches that run over it look at
+ * the chunks after it.
+ */
+
+// Bytes of the buffer a thread searches at a time
+#define PARALLEL_CHUNK (1 << 20)
+
+typedef struct {
+  int nchunks;
+  long budget;
+  void (*search)(void *data, int chunk, regex_scratch *scratch);
+  void *data;
+  // Set for every chunk once it is searched
+  bool *done;
+  // Index of the next chunk to search
+  atomic_int next;
+  // Set once the chunks left aren't needed
+  atomic_bool stop;
+  // Signaled whenever a chunk is done
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} chunk_pool;
+
+static void *search_chunks(void *arg) {
+  chunk_pool *p = arg;
+  regex_scratch *w = mk_regex_scratch();
+  regex_scratch_budget(w, p->budget);
+  for (int i; !atomic_load(&p->stop) && (i = atomic_fetch_add(&p->next, 1)) < p->nchunks;) {
+    p->search(p->data, i, w);
+    pthread_mutex_lock(&p->lock);
+    p->done[i] = true;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+  }
+  destroy_regex_scratch(w);
+  return NULL;
+}
+
+void regex_search_chunks(int nchunks, int nthreads, long budget,
+                         void (*search)(void *data, int chunk, regex_scratch *scratch),
+                         bool (*done)(void *data, int chunk), void *data) {
+  chunk_pool p = {.nchunks = nchunks, .budget = budget, .search = search, .data = data};
+  p.done = ecalloc(nchunks > 0 ? nchunks : 1, sizeof(bool));
+  pthread_mutex_init(&p.lock, NULL);
+  pthread_cond_init(&p.cond, NULL);
+  nthreads = nthreads < 1 ? 1 : nthreads < nchunks ? nthreads : nchunks;
+  pthread_t *threads = ecalloc(nthreads > 0 ? nthreads : 1, sizeof(pthread_t));
+  int started = 0;
+  while (started < nthreads && pthread_create(&threads[started], NULL, search_chunks, &p) == 0)
+    started++;
+  // Without any thread, the chunks are searched here before they are passed on
+  if (started == 0 && nchunks > 0)
+    search_chunks(&p);
+
+  bool more = true;
+  for (int i = 0; i < nchunks && more; i++) {
+    pthread_mutex_lock(&p.lock);
+    while (!p.done[i])
+      pthread_cond_wait(&p.cond, &p.lock);
+    pthread_mutex_unlock(&p.lock);
+    more = done(data, i);
+  }
+
+  atomic_store(&p.stop, true);
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+  free(p.done);
+  pthread_mutex_destroy(&p.lock);
+  pthread_cond_destroy(&p.cond);
+}
+
+typedef struct {
+  // Where the search started, and the match it found. start is -1 if no match starts before the end of the chunk,
+  // and end is MATCH_ABORTED if the search was given up.
+  long from;
+  long start;
+  long end;
+} chunk_search;
+
+typedef struct {
+  regex *r;
+  string_slice s;
+  // The searches of every chunk
+  vec *searches;
+  // Scratch of the calling thread, for searching chunks again
+  regex_scratch *scratch;
+  // Where the iteration over the whole buffer is
+  long pos;
+  long count;
+  bool (*f)(regex_match m, void *data);
+  void *data;
+} parallel_search;
+
+static long chunk_end(const parallel_search *p, int i) {
+  long end = (long)(i + 1) * PARALLEL_CHUNK;
+  return end < p->s.n ? end : p->s.n;
+}
+
+// Find the leftmost-first match in s from `from` on, if it starts before limit.
+// Returns its end, -1 or MATCH_ABORTED.
+static long search_from(regex *r, regex_scratch *w, string_slice s, long from, long limit, long *start) {
+  begin_match(w);
+  long end = from < s.n ? search(r, w, s.str + from, s.n - from, limit - from, start) : -1;
+  end_match(r, w, end == MATCH_ABORTED);
+  *start = end < 0 ? -1 : *start + from;
+  return end < 0 ? end : end + from;
+}
+
+static void list_searches(void *data, int i, regex_scratch *w) {
+  parallel_search *p = data;
+  vec *searches = &p->searches[i];
+  long limit = chunk_end(p, i);
+  for (long pos = (long)i * PARALLEL_CHUNK; pos < limit;) {
+    chunk_search cs = {.from = pos};
+    cs.end = search_from(p->r, w, p->s, pos, limit, &cs.start);
+    vec_push(searches, &cs);
+    if (cs.end < 0)
+      break;
+    pos = cs.end > cs.start ? cs.end : cs.end + 1;
+  }
+}
+
+// Continue the iteration over the whole buffer through chunk i, and return whether it goes on
+static bool join_searches(void *data, int i) {
+  parallel_search *p = data;
+  const chunk_search *searches = p->searches[i].array;
+  int nsearches = p->searches[i].n;
+  long limit = chunk_end(p, i);
+  bool more = true;
+  for (int k = 0; more && p->pos < limit;) {
+    // The last search of the chunk that started at or before pos finds the same match, unless pos is past its start
+    while (k + 1 < nsearches && searches[k + 1].from <= p->pos)
+      k++;
+    long start = searches[k].start, end = searches[k].end;
+    if ((end >= 0 && p->pos > start) || (end == MATCH_ABORTED && p->pos > searches[k].from))
+      end = search_from(p->r, p->scratch, p->s, p->pos, limit, &start);
+    if (end == MATCH_ABORTED) {
+      // Like an iterator, a search given up ends the iteration
+      p->f((regex_match){.aborted = true}, p->data);
+      more = false;
+      break;
+    }
+    if (end < 0) {
+      // No match starts before the end of the chunk, so the next one continues from there
+      p->pos = limit;
+      break;
+    }
+    p->count++;
+    more = p->f((regex_match){.match = true, .matched = {.n = end - start, .str = p->s.str + start}}, p->data);
+    p->pos = end > start ? end : end + 1;
+  }
+  vec_destroy(&p->searches[i]);
+  return more && p->pos < p->s.n;
+}
+
+long regex_find_parallel(regex *r, string_slice s, int nthreads, long budget, bool (*f)(regex_match m, void *data),
+                         void *data) {
+  int nchunks = (s.n + PARALLEL_CHUNK - 1) / PARALLEL_CHUNK;
+  parallel_search p = {.r = r, .s = s, .scratch = mk_regex_scratch(), .f = f, .data = data};
+  regex_scratch_budget(p.scratch, budget);
+  p.searches = ecalloc(nchunks > 0 ? nchunks : 1, sizeof(vec));
+  for (int i = 0; i < nchunks; i++)
+    p.searches[i] = v_make(chunk_search);
+  regex_search_chunks(nchunks, nthreads, budget, list_searches, join_searches, &p);
+  // Chunks the iteration stopped before
+  for (int i = 0; i < nchunks; i++)
+    vec_destroy(&p.searches[i]);
+  destroy_regex_scratch(p.scratch);
+  free(p.searches);
+  return p.count;
+}
+
+regex_match regex_find_r(regex *r, const char *string, regex_scratch *scratch) {
+  return regex_find_slice_r(r, (string_slice){.n = strlen(string), .str = string}, scratch);
+}
+
+int regex_set_matches_r(regex_set *s, match_context *ctx, long *ends, regex_scratch *scratch) {
+  begin_match(scratch);
+  bool aborted = set_match(s, scratch, ctx->view.str + ctx->c, ctx->view.n - ctx->c, ends) == MATCH_ABORTED;
+  end_match(s->r, scratch, aborted);
+  if (aborted) {
+    for (int i = 0; i < s->n; i++)
+      ends[i] = -1;
+    return -1;
+  }
+  int count = 0;
+  for (int i = 0; i < s->n; i++)
+    count += ends[i] >= 0;
+  return count;
+}
+
+int regex_set_matches(regex_set *s, match_context *ctx, long *ends) {
+  return regex_set_matches_r(s, ctx, ends, thread_scratch());
+}
+
+regex_match regex_find(regex *r, const char *string) { return regex_find_r(r, string, thread_scratch()); }
+
+regex_match regex_longest_r(regex *r, match_context *ctx, regex_scratch *scratch) {
+  int pos = ctx->c;
+  begin_match(scratch);
+  long end = longest_match(r, scratch, ctx->view.str + pos, ctx->view.n - pos);
+  end_match(r, scratch, end == MATCH_ABORTED);
+  if (end < 0)
+    return (regex_match){.aborted = end == MATCH_ABORTED};
+  ctx->c = pos + end;
+  return (regex_match){.match = true, .matched = {.n = end, .str = ctx->view.str + pos}};
+}
+
+regex_match regex_longest(regex *r, match_context *ctx) { return regex_longest_r(r, ctx, thread_scratch()); }
+
+regex_match regex_find_longest_r(regex *r, const char *string, regex_scratch *scratch) {
+  long n = strlen(string);
+  begin_match(scratch);
+  long start, end = n ? search_longest(r, scratch, string, n, &start) : -1;
+  end_match(r, scratch, end == MATCH_ABORTED);
+  if (end < 0)
+    return (regex_match){.aborted = end == MATCH_ABORTED};
+  return (regex_match){.match = true, .matched = {.n = end - start, .str = string + start}};
+}
+
+regex_match regex_find_longest(regex *r, const char *string) {
+  return regex_find_longest_r(r, string, thread_scratch());
+}
+
+/* Streams
+ * A stream keeps the threads of a search between chunks, with the offset every thread started at, so it never
+ * needs to see earlier input again. The dfa can't tell where a match starts, so streams always simulate the nfa,
+ * but skip input no match can start with while no thread is alive.
+ * A match is only complete once every thread that could replace it died, which can take input past its end. The
+ * next match may start in that input, so the stream holds on to it and searches it again after reporting the match.
+ */
+
+struct regex_stream {
+  regex *r;
+  // The threads live in the scratch between chunks, so it isn't shared with anything else
+  regex_scratch *w;
+  threadlist lists[2];
+  // Index of the current threads in lists
+  int cur;
+  // Offset of the next byte
+  long pos;
+  // New threads only start from here, so a match never starts inside the previous one
+  long from;
+  // The best match so far, if the current threads found one
+  long start, end;
+  // Input from held_at on that has to be searched again once the current match is reported
+  vec held;
+  long held_at;
+};
+
+// Forget all threads, and only start new ones from `from`
+static void stream_restart(regex_stream *s, long from) {
+  threadlist *l = &s->lists[s->cur];
+  next_generation(s->w);
+  l->n = 0;
+  l->match = l->found = false;
+  s->from = from;
+}
+
+// Report the best match, and go back to its end to look for the next one
+static long stream_report(regex_stream *s, regex_stream_match *m, long consumed) {
+  *m = (regex_stream_match){.match = true, .start = s->start, .end = s->end};
+  s->pos = s->end;
+  stream_restart(s, s->end > s->start ? s->end : s->end + 1);
+  return consumed;
+}
+
+// Record a match up to the current offset. Held input before it isn't needed anymore, unless it is being searched.
+static void stream_match(regex_stream *s, long start, bool replay) {
+  s->start = start;
+  s->end = s->pos;
+  if (!replay) {
+    s->held.n = 0;
+    s->held_at = s->pos;
+  }
+}
+
+// Run the threads over n bytes at the current offset, holding on to them while a match is pending unless they are
+// held already. Returns the number of bytes consumed before a match was complete, or n.
+static long stream_run(regex_stream *s, const u8 *c, long n, bool replay, regex_stream_match *m) {
+  const regex *r = s->r;
+  for (long i = 0;; i++) {
+    threadlist *cur = &s->lists[s->cur];
+    // Without threads that could still replace it, the match is complete
+    if (cur->found && cur->n == 0)
+      return stream_report(s, m, i);
+    if (!cur->found && cur->n == 0) {
+      while (i < n && (s->pos < s->from || !r->first[c[i]])) {
+        i++;
+        s->pos++;
+      }
+      next_generation(s->w);
+    }
+    if (i == n)
+      return n;
+    // A new thread only starts once there is input for it, so no match starts at the end of the stream
+    if (!cur->found && s->pos >= s->from) {
+      seed(s->w, cur, s->pos);
+      if (cur->match) {
+        stream_match(s, s->pos, replay);
+        if (cur->n == 0)
+          return stream_report(s, m, i);
+      }
+    }
+    threadlist *next = &s->lists[!s->cur];
+    step(s->w, cur, c[i], next);
+    s->cur = !s->cur;
+    s->pos++;
+    if (next->match)
+      stream_match(s, next->match_start, replay);
+    else if (next->found && !replay)
+      vec_push(&s->held, &c[i]);
+  }
+}
+
+// Search the held input up to the current offset again. Returns true if that completes a match.
+static bool stream_replay(regex_stream *s, regex_stream_match *m) {
+  // Drop input that can't be needed anymore
+  long keep = s->lists[s->cur].found ? s->end : s->pos;
+  if (keep > s->held_at) {
+    long drop = keep - s->held_at < s->held.n ? keep - s->held_at : s->held.n;
+    if (s->held.n > drop)
+      memmove(s->held.array, (u8 *)s->held.array + drop, s->held.n - drop);
+    s->held.n -= drop;
+    s->held_at += drop;
+  }
+  while (s->pos < s->held_at + s->held.n) {
+    long i = s->pos - s->held_at;
+    stream_run(s, (u8 *)s->held.array + i, s->held.n - i, true, m);
+    if (m->match)
+      return true;
+  }
+  return false;
+}
+
+regex_stream *mk_regex_stream(regex *r) {
+  regex_stream *s = ecalloc(1, sizeof(regex_stream));
+  s->r = r;
+  s->w = mk_regex_scratch();
+  s->held = v_make(u8);
+  scratch_init(s->w, r, MATCH_SEARCH);
+  for (int i = 0; i < 2; i++)
+    s->lists[i] = (threadlist){.arr = s->w->lists[i], .starts = s->w->starts[i]};
+  stream_restart(s, 0);
+  return s;
+}
+
+void destroy_regex_stream(regex_stream *s) {
+  if (s) {
+    destroy_regex_scratch(s->w);
+    vec_destroy(&s->held);
+    free(s);
+  }
+}
+
+long regex_stream_feed(regex_stream *s, const char *chunk, long n, regex_stream_match *m) {
+  *m = (regex_stream_match){0};
+  if (stream_replay(s, m))
+    return 0;
+  return stream_run(s, (const u8 *)chunk, n, false, m);
+}
+
+bool regex_stream_end(regex_stream *s, regex_stream_match *m) {
+  *m = (regex_stream_match){0};
+  if (stream_replay(s, m))
+    return true;
+  if (s->lists[s->cur].found) {
+    stream_report(s, m, 0);
+    return true;
+  }
+  s->pos = s->held_at = 0;
+  s->held.n = 0;
+  stream_restart(s, 0);
+  return false;
+}
+
+bool regex_stream_pending(const regex_stream *s) {
+  const threadlist *l = &s->lists[s->cur];
+  return l->n > 0 || l->found || s->pos < s->held_at + s->held.n;
+}
+
+long regex_stream_keep(const regex_stream *s) {
+  const threadlist *l = &s->lists[s->cur];
+  long keep = l->found ? s->start : s->pos;
+  for (int i = 0; i < l->n; i++)
+    keep = l->starts[i] < keep ? l->starts[i] : keep;
+  return keep;
+}
+
+// Extract the captures of the match at the beginning of s in groups, and return its length or -1
+static long captures(regex *r, regex_scratch *w, const char *s, long n, string_slice *groups) {
+  scratch_init_captures(w, r);
+  long *slots = w->path + 2 * r->ngroups;
+  long end = capture_exec(w, (const u8 *)s, n, slots);
+  if (end < 0)
+    return end;
+  groups[0] = (string_slice){.n = end, .str = s};
+  for (int i = 0; i < r->ngroups; i++) {
+    long from = slots[2 * i], to = slots[2 * i + 1];
+    groups[i + 1] = from >= 0 && to >= from ? (string_slice){.n = to - from, .str = s + from} : (string_slice){0};
+  }
+  return end;
+}
+
+regex_match regex_captures_r(regex *r, match_context *ctx, string_slice *groups, regex_scratch *scratch) {
+  int pos = ctx->c;
+  begin_match(scratch);
+  long end = captures(r, scratch, ctx->view.str + pos, ctx->view.n - pos, groups);
+  end_match(r, scratch, end == MATCH_ABORTED);
+  if (end < 0)
+    return (regex_match){.aborted = end == MATCH_ABORTED};
+  ctx->c = pos + end;
+  return (regex_match){.match = true, .matched = groups[0]};
+}
+
+regex_match regex_captures(regex *r, match_context *ctx, string_slice *groups) {
+  return regex_captures_r(r, ctx, groups, thread_scratch());
+}
+
+regex_match regex_find_captures_r(regex *r, const char *string, string_slice *groups, regex_scratch *scratch) {
+  // Only the match found by the search is simulated again to extract the groups
+  begin_match(scratch);
+  regex_match m = find(r, mk_slice(string), scratch);
+  if (m.match && captures(r, scratch, m.matched.str, m.matched.n, groups) == MATCH_ABORTED)
+    m = (regex_match){.aborted = true};
+  end_match(r, scratch, m.aborted);
+  return m;
+}
+
+regex_match regex_find_captures(regex *r, const char *string, string_slice *groups) {
+  return regex_find_captures_r(r, string, groups, thread_scratch());
+}
+
+bool matches(const char *pattern, const char *string) {
+  regex *r = mk_regex(pattern);
+  if (r == NULL) {
+    return false;
+  }
+  bool result = regex_matches_strict(r, string);
+  destroy_regex(r);
+  return result;
+}
+
+void regex_first(regex *r, char map[static UINT8_MAX]) {
+  if (r == NULL)
+    return;
+  reach c = {
+      .r = r,
+      .seen = ecalloc(r->nstates, sizeof(bool)),
+      .stack = v_make(uint32_t),
+      .states = ecalloc(r->nstates, sizeof(uint32_t)),
+  };
+  uint32_t start = 0;
+  epsilon_closure(&c, &start, 1);
+  for (int i = 0; i < c.n; i++) {
+    for (int ch = r->states[c.states[i]].lo; ch <= r->states[c.states[i]].hi; ch++)
+      map[ch] = 1;
+  }
+  free(c.seen);
+  free(c.states);
+  vec_destroy(&c.stack);
+}
+
+bool regex_accepts(const regex *r, u8 ch) {
+  for (int i = 0; i < r->nstates; i++) {
+    if (r->states[i].kind == STATE_CHAR && r->states[i].lo <= ch && ch <= r->states[i].hi)
+      return true;
+  }
+  return false;
 }
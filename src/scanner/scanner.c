@@ -60,15 +60,27 @@ int next_token(scanner *s, const bool *valid, string_slice *content) {
   if (finished(s->ctx))
     return EOF_TOKEN;
 
+  // Match all tokens in one pass, then pick the first valid one.
+  // Scanners that weren't made by mk_scanner have no set, so their tokens are matched one by one.
+  if (s->set)
+    regex_set_matches(s->set, s->ctx, s->ends);
   v_foreach(token, t, s->tokens) {
-    if (t->pattern && (valid == NULL || valid[idx_t])) {
-      regex_match m = regex_matches(t->pattern, s->ctx);
-      if (m.match) {
-        if (content)
-          *content = m.matched;
-        tok = idx_t;
-        break;
-      }
+    if (!t->pattern || (valid && !valid[idx_t]))
+      continue;
+    long end = -1;
+    if (s->set) {
+      end = s->ends[idx_t];
+    } else {
+      match_context ctx = *s->ctx;
+      regex_match m = regex_matches(t->pattern, &ctx);
+      end = m.match ? m.matched.n : -1;
+    }
+    if (end >= 0) {
+      if (content)
+        *content = (string_slice){.str = s->ctx->view.str + s->ctx->c, .n = end};
+      s->ctx->c += end;
+      tok = idx_t;
+      break;
     }
   }
   while (peek(s->ctx) == ' ' || peek(s->ctx) == '\n' || peek(s->ctx) == '\t')
@@ -115,12 +127,21 @@ scanner mk_scanner(const scanner_tokens tokens) {
       if (r == NULL)
         die("Failed to parse regex from %s", t->pattern);
       n = (token){.pattern = r, .name = mk_slice(t->name), .id = i};
+      byte_classes_add(&s.classes, r);
     }
     vec_push(&s.tokens, &n);
   }
+  const char **patterns = ecalloc(tokens.n, sizeof(char *));
+  for (int i = 0; i < tokens.n; i++)
+    patterns[i] = tokens.tokens[i].pattern;
+  s.set = mk_regex_set(patterns, tokens.n);
+  s.ends = ecalloc(tokens.n, sizeof(long));
+  free(patterns);
   return s;
 }
 void destroy_scanner(scanner *s) {
   v_foreach(token, t, s->tokens) { destroy_regex(t->pattern); }
   vec_destroy(&s->tokens);
+  destroy_regex_set(s->set);
+  free(s->ends);
 }
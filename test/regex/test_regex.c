@@ -126,6 +126,21 @@ int main(void) {
       {"ab*",                 "ab",              true },
       {"ab*",                 "abab",            false},
       {"ab*",                 "abb",             true },
+      // counted repetition
+      {"a{3}",                "aaa",             true },
+      {"a{3}",                "aa",              false},
+      {"a{3}",                "aaaa",            false},
+      {"a{2,}",               "aaaaa",           true },
+      {"a{2,}",               "a",               false},
+      {"a{1,3}b",             "aaab",            true },
+      {"a{1,3}b",             "aaaab",           false},
+      {"a{0,2}?b",            "ab",              true },
+      {"(ab|c){2}",           "abc",             true },
+      {"[0-9a-f]{4}-\\d{2}",  "0a9f-12",         true },
+      {"x{0}y",               "y",               true },
+      {"{",                   "{",               true },
+      {"a{,2}",               "a{,2}",           true },
+      {"a{2",                 "a{2",             true },
   };
 
   int status = 0;
@@ -142,11 +157,25 @@ int main(void) {
       status++;
     }
   }
+  // The arrays of an automaton are aligned for their types, even after the odd length copy of the pattern
+  const char *sources[] = {"(a|ab)(c|bcd)(d*)x", "if", NULL};
+  regex *r = mk_regex(sources[0]);
+  regex_set *set = mk_regex_set(sources, 3);
+  if ((size_t)r->states % _Alignof(regex_state) || (size_t)r->edges % _Alignof(uint32_t) ||
+      (size_t)set->r->pattern % _Alignof(int)) {
+    error("Misaligned automaton of %s", sources[0]);
+    status++;
+  }
+  destroy_regex_set(set);
+  destroy_regex(r);
   set_loglevel(LL_FATAL);
-  pair invalid = {"h+*", "hhh", false};
-  regex *r = mk_regex(invalid.pattern);
-  if (r != NULL)
-    die("Parsing %s succeeded. Should fail.");
+  // Counts that are reversed or would need too many states are rejected as well
+  char *invalid[] = {"h+*", "a{3,2}", "a{1001}", "(a{1000}){1000}", "a{99999}", "a{1,123456}"};
+  for (int i = 0; i < (int)(sizeof(invalid) / sizeof(char *)); i++) {
+    regex *r = mk_regex(invalid[i]);
+    if (r != NULL)
+      die("Parsing %s succeeded. Should fail.", invalid[i]);
+  }
   assert2(log_severity() <= LL_INFO);
   return status;
 }
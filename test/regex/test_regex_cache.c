@@ -0,0 +1,82 @@
+// link: regex.o arena.o collections.o logging.o
+#include <pthread.h>
+#include <stdio.h>
+
+#include "../unittest.h"
+#include "logging.h"
+#include "macros.h"
+#include "regex.h"
+
+#define THREADS 4
+#define ROUNDS 200
+
+static const char *patterns[] = {"[0-9]+", "(a|b)*c", "x{2,3}", "[a-z]+=[a-z]*"};
+
+// Compile and drop the same patterns from several threads at once, while the cache evicts them
+static void *worker(void *arg) {
+  long id = (long)arg;
+  long failures = 0;
+  char unique[32];
+  for (int round = 0; round < ROUNDS; round++) {
+    regex *r = mk_regex(patterns[(round + id) % LENGTH(patterns)]);
+    snprintf(unique, sizeof(unique), "t%ldr%d", id, round);
+    regex *other = mk_regex(unique);
+    failures += !regex_matches_strict(other, unique);
+    failures += r == NULL;
+    destroy_regex(other);
+    destroy_regex(r);
+  }
+  return (void *)failures;
+}
+
+int main(void) {
+  int status = 0;
+
+  regex *a = mk_regex("(a|b)*c");
+  regex *b = mk_regex_from_slice((string_slice){.n = 7, .str = "(a|b)*cd"});
+  if (a != b) {
+    error("Compiling %s twice gave different regexes", "(a|b)*c");
+    status++;
+  }
+  destroy_regex(b);
+  // The regex stays valid while it is used, even when the cache drops it
+  regex_cache_clear();
+  if (!regex_matches_strict(a, "abbac")) {
+    error("Cached regex stopped matching");
+    status++;
+  }
+  destroy_regex(a);
+
+  // Sets are told apart by every pattern, and a NULL pattern differs from an empty one
+  const char *first[] = {"ab", NULL};
+  const char *second[] = {"ab", ""};
+  regex_set *s1 = mk_regex_set(first, LENGTH(first));
+  regex_set *s2 = mk_regex_set(second, LENGTH(second));
+  regex_set *s3 = mk_regex_set(first, LENGTH(first));
+  regex *single = mk_regex("ab");
+  if (s1->r != s3->r || s1->r == s2->r || s1->r == single) {
+    error("Sets were not cached by their patterns");
+    status++;
+  }
+  destroy_regex_set(s1);
+  destroy_regex_set(s2);
+  destroy_regex_set(s3);
+  destroy_regex(single);
+
+  pthread_t threads[THREADS];
+  for (long i = 0; i < THREADS; i++)
+    pthread_create(&threads[i], NULL, worker, (void *)i);
+  long failures = 0;
+  for (int i = 0; i < THREADS; i++) {
+    void *result;
+    pthread_join(threads[i], &result);
+    failures += (long)result;
+  }
+  if (failures) {
+    error("%d regexes failed to compile or match", (int)failures);
+    status++;
+  }
+
+  assert2(log_severity() <= LL_INFO);
+  return status;
+}
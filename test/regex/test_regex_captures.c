@@ -0,0 +1,88 @@
+// link: regex.o arena.o collections.o logging.o
+#include <string.h>
+
+#include "../unittest.h"
+#include "logging.h"
+#include "macros.h"
+#include "regex.h"
+
+#define MAX_GROUPS 4
+
+typedef struct {
+  const char *pattern;
+  const char *input;
+  // Expected whole match and groups, NULL for groups that take no part in the match.
+  // The match is searched for if `find` is set, and anchored at the start otherwise.
+  const char *groups[MAX_GROUPS + 1];
+  bool find;
+} testcase;
+
+int main(void) {
+  testcase testcases[] = {
+      {"(a)(b)",                 "abc",             {"ab", "a", "b"},                false},
+      {"(a|ab)(c|bcd)(d*)",      "abcd",            {"abcd", "a", "bcd", ""},        false},
+      {"(a*?)(a*)",              "aaa",             {"aaa", "", "aaa"},              false},
+      {"(a|(b))+",               "aba",             {"aba", "a", "b"},               false},
+      {"(a)|(b)",                "b",               {"b", NULL, "b"},                false},
+      {"((a)|b)+",               "ab",              {"ab", "b", "a"},                false},
+      {"x(\\d+)-(\\d+)",         "x12-345",         {"x12-345", "12", "345"},        false},
+      {"([a-z]+)=([^;]*);",      "key=value;rest",  {"key=value;", "key", "value"},  false},
+      {"(a)?b",                  "b",               {"b", NULL},                     false},
+      {"(\\d+)\\.(\\d+)",        "version 10.42 ",  {"10.42", "10", "42"},            true },
+      {"(x)(y)?",                "aaxb",            {"x", "x", NULL},                true },
+      {"([ab]*)c",               "ababd abc",       {"abc", "ab"},                   true },
+  };
+
+  int status = 0;
+  for (int i = 0; i < LENGTH(testcases); i++) {
+    testcase *t = &testcases[i];
+    regex *r = mk_regex(t->pattern);
+    string_slice groups[MAX_GROUPS + 1];
+    regex_match m;
+    if (t->find) {
+      m = regex_find_captures(r, t->input, groups);
+    } else {
+      match_context ctx = mk_ctx(t->input);
+      m = regex_captures(r, &ctx, groups);
+      if (m.match && ctx.c != m.matched.n) {
+        error("Captures of %s on %s moved the cursor to %d", t->pattern, t->input, ctx.c);
+        status++;
+      }
+    }
+    if (!m.match) {
+      error("No match for %s on %s", t->pattern, t->input);
+      status++;
+      destroy_regex(r);
+      continue;
+    }
+    for (int g = 0; g <= r->ngroups; g++) {
+      const char *expected = t->groups[g];
+      bool same = expected ? groups[g].str && groups[g].n == (int)strlen(expected) &&
+                                 strncmp(groups[g].str, expected, groups[g].n) == 0
+                           : groups[g].str == NULL;
+      if (!same) {
+        error("Group %d of %s on %s is '%S', expected '%s'", g, t->pattern, t->input, groups[g],
+              expected ? expected : "NULL");
+        status++;
+      }
+    }
+    destroy_regex(r);
+  }
+
+  // Extracting groups takes linear time like any other match
+  regex *r = mk_regex("((a|a)*)(b?)");
+  char *input = ecalloc(10001, 1);
+  memset(input, 'a', 10000);
+  match_context ctx = mk_ctx(input);
+  string_slice groups[4];
+  regex_match m = regex_captures(r, &ctx, groups);
+  if (!m.match || groups[1].n != 10000 || groups[2].str != input + 9999 || groups[3].n != 0) {
+    error("Captures on %d characters", 10000);
+    status++;
+  }
+  free(input);
+  destroy_regex(r);
+
+  assert2(log_severity() <= LL_INFO);
+  return status;
+}
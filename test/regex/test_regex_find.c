@@ -33,21 +33,32 @@ int main(void) {
       {.pattern = string_regex, .string = "ab \"runaway string \\\" 2", .match = false},
       {.pattern = string_regex, .string = "leading \"str \\\"escaped!\" rest", .match = true, .start = 8, .length = 16},
       {.pattern = string_regex, .string = "ab \"str \\\"escaped!\" rest", .match = true, .start = 3, .length = 16},
+      // Patterns with a literal prefix or a required literal in the middle
+      {.pattern = "abc", .string = "ababcabc", .match = true, .start = 2, .length = 3},
+      {.pattern = "(ab|ac)d", .string = "abacadacd", .match = true, .start = 6, .length = 3},
+      {.pattern = "[a-z]+@example", .string = "mail bob@exampl or ann@example", .match = true, .start = 19, .length = 11},
+      {.pattern = "[a-z]+@example", .string = "mail bob@exampl", .match = false},
+      {.pattern = "(a|b)*xyz", .string = "abab xy abxyz", .match = true, .start = 8, .length = 5},
+      {.pattern = "x*", .string = "abc", .match = true, .start = 0, .length = 0},
+      {.pattern = "[0-9]+", .string = "abc 123", .match = true, .start = 4, .length = 3},
   };
+  int status = 0;
   for (int i = 0; i < LENGTH(ts); i++) {
     testcase *t = &ts[i];
     regex_match m = match(t);
     if (t->match != m.match) {
       printf("test failed: match '%s' on '%s'\nyielded  %s\nexpected %s\n", t->pattern, t->string,
              m.match ? "match" : "no match", t->match ? "match" : "no match");
+      status++;
       if (m.match) {
         printf("matched: %.*s\n", m.matched.n, m.matched.str);
       }
     } else if (t->match && ((t->string + t->start) != m.matched.str || t->length != m.matched.n)) {
       printf("test failed: match '%s' on '%s'\nyielded  %.*s\nexpected %.*s\n", t->pattern, t->string, m.matched.n,
              m.matched.str, (int)t->length, t->string + t->start);
+      status++;
     }
   }
   assert2(log_severity() <= LL_INFO);
-  return 0;
+  return status;
 }
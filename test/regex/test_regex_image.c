@@ -0,0 +1,98 @@
+// link: regex.o arena.o collections.o logging.o
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../unittest.h"
+#include "logging.h"
+#include "macros.h"
+#include "regex.h"
+
+static const char *patterns[] = {"(a|b)*c", "hello [a-z]+", "(\\d+)-(\\d+)", string_regex};
+static const char *set_patterns[] = {"(i)f", "[a-z]+", NULL};
+
+// Regexes loaded from an image are used in place, and match like the ones they were saved from
+int main(void) {
+  int status = 0;
+  regex *regexes[LENGTH(patterns)];
+  for (int i = 0; i < LENGTH(patterns); i++)
+    regexes[i] = mk_regex(patterns[i]);
+  regex_set *set = mk_regex_set(set_patterns, LENGTH(set_patterns));
+
+  char *image;
+  size_t size;
+  FILE *f = open_memstream(&image, &size);
+  if (!regex_save_cache(f)) {
+    error("Failed to save the cache");
+    status++;
+  }
+  fclose(f);
+  for (int i = 0; i < LENGTH(patterns); i++)
+    destroy_regex(regexes[i]);
+  destroy_regex_set(set);
+  regex_cache_clear();
+
+  // Images that are cut short, damaged or misaligned load nothing
+  char *copy = malloc(size + 8);
+  memcpy(copy, image, size);
+  if (regex_load_cache(copy, size - 8) != -1 || regex_load_cache(copy + 8, size - 8) != -1) {
+    error("Loaded a truncated image");
+    status++;
+  }
+  memset(copy + 32, 0xff, 8);
+  if (regex_load_cache(copy, size) != -1) {
+    error("Loaded a damaged image");
+    status++;
+  }
+  memmove(copy + 1, image, size);
+  if (regex_load_cache(copy + 1, size) != -1) {
+    error("Loaded a misaligned image");
+    status++;
+  }
+  free(copy);
+
+  int loaded = regex_load_cache(image, size);
+  if (loaded != LENGTH(patterns) + 1) {
+    error("Loaded %d regexes, expected %d", loaded, LENGTH(patterns) + 1);
+    status++;
+  }
+  for (int i = 0; i < LENGTH(patterns); i++) {
+    regex *r = mk_regex(patterns[i]);
+    if ((char *)r->states < image || (char *)r->states >= image + size) {
+      error("%s was compiled again instead of loaded", patterns[i]);
+      status++;
+    }
+    destroy_regex(r);
+  }
+
+  regex *r = mk_regex("(\\d+)-(\\d+)");
+  string_slice groups[3];
+  match_context ctx = mk_ctx("12-345");
+  regex_match m = regex_captures(r, &ctx, groups);
+  if (!m.match || groups[1].n != 2 || groups[2].n != 3) {
+    error("Captures of a loaded regex");
+    status++;
+  }
+  destroy_regex(r);
+  r = mk_regex("hello [a-z]+");
+  m = regex_find(r, "say hello world");
+  if (!m.match || m.matched.n != 11 || !regex_matches_strict(r, "hello abc") || regex_matches_strict(r, "hello")) {
+    error("Matches of a loaded regex");
+    status++;
+  }
+  destroy_regex(r);
+  set = mk_regex_set(set_patterns, LENGTH(set_patterns));
+  long ends[LENGTH(set_patterns)];
+  ctx = mk_ctx("iffy");
+  if ((char *)set->r->states < image || regex_set_matches(set, &ctx, ends) != 2 || ends[0] != 2 || ends[1] != 4) {
+    error("Matches of a loaded set");
+    status++;
+  }
+  destroy_regex_set(set);
+
+  // The regexes are dropped before the image they live in
+  regex_cache_clear();
+  free(image);
+  assert2(log_severity() <= LL_INFO);
+  return status;
+}
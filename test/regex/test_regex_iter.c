@@ -0,0 +1,78 @@
+// link: regex.o arena.o collections.o logging.o
+#include <string.h>
+
+#include "../unittest.h"
+#include "logging.h"
+#include "macros.h"
+#include "regex.h"
+
+#define LEN 100000
+
+// The iterator finds the same matches as calling regex_find again after every match
+static int check(const char *pattern, const char *input) {
+  regex *r = mk_regex(pattern);
+  regex_iter it = mk_regex_iter(r, (string_slice){.n = strlen(input), .str = input});
+  int failures = 0;
+  long from = 0, n = strlen(input);
+  while (true) {
+    regex_match expected = from < n ? regex_find(r, input + from) : (regex_match){0};
+    regex_match m = regex_iter_next(&it);
+    if (m.match != expected.match ||
+        (m.match && (m.matched.str != expected.matched.str || m.matched.n != expected.matched.n))) {
+      error("%s in %s: iterator found %d at %d, expected %d at %d", pattern, input, m.match ? m.matched.n : -1,
+            m.match ? (int)(m.matched.str - input) : -1, expected.match ? expected.matched.n : -1,
+            expected.match ? (int)(expected.matched.str - input) : -1);
+      failures++;
+      break;
+    }
+    if (!m.match)
+      break;
+    from = m.matched.str + m.matched.n - input + !m.matched.n;
+  }
+  destroy_regex(r);
+  return failures;
+}
+
+int main(void) {
+  const char *patterns[] = {"a+b", "x*", "(a|ab)(c|bcd)", "a*?b|a+", "\\d+(\\.\\d+)?", "abc|bcd|cde", ""};
+  const char *inputs[] = {"", "aab", "xaab aaab ab b", "abcd abc acd", "aaaa", "12.5 3. 4.25x", "abcdef"};
+
+  int status = 0;
+  for (int i = 0; i < LENGTH(patterns); i++) {
+    for (int j = 0; j < LENGTH(inputs); j++)
+      status += check(patterns[i], inputs[j]);
+  }
+
+  // The length is explicit, so the buffer can contain NUL bytes and end without one
+  regex *r = mk_regex("[0-9]+");
+  const char buffer[] = {'1', '2', '\0', 'x', '3', '4', '5'};
+  regex_iter it = mk_regex_iter(r, (string_slice){.n = sizeof(buffer), .str = buffer});
+  regex_match first = regex_iter_next(&it), second = regex_iter_next(&it), third = regex_iter_next(&it);
+  if (!first.match || first.matched.n != 2 || !second.match || second.matched.str != buffer + 4 ||
+      second.matched.n != 3 || third.match) {
+    error("Matches of %s in a buffer with NUL bytes", "[0-9]+");
+    status++;
+  }
+  destroy_regex(r);
+
+  // Matches in a long buffer are found by one pass over it
+  char *input = ecalloc(LEN + 1, 1);
+  for (int i = 0; i < LEN; i++)
+    input[i] = i % 10 == 9 ? ' ' : 'a' + i % 10;
+  r = mk_regex("[a-z]+");
+  regex_scratch *w = mk_regex_scratch();
+  it = mk_regex_iter_r(r, (string_slice){.n = LEN, .str = input}, w);
+  long count = 0, bytes = 0;
+  for (regex_match m; (m = regex_iter_next(&it)).match; count++)
+    bytes += regex_scratch_stats(w)->dfa_bytes + regex_scratch_stats(w)->nfa_bytes;
+  if (count != LEN / 10 || bytes > 3 * LEN) {
+    error("%d matches of %s took %d bytes of matching", (int)count, "[a-z]+", (int)bytes);
+    status++;
+  }
+  destroy_regex_scratch(w);
+  destroy_regex(r);
+  free(input);
+
+  assert2(log_severity() <= LL_INFO);
+  return status;
+}
@@ -0,0 +1,66 @@
+// link: regex.o arena.o collections.o logging.o
+#include <string.h>
+
+#include "../unittest.h"
+#include "logging.h"
+#include "macros.h"
+#include "regex.h"
+
+// Compiled regexes match exactly like the interpreter, where the platform supports compiling them
+int main(void) {
+  const char *patterns[] = {
+      "a|ab|abc",     "(a|b)*abb",    "[0-9]+(\\.[0-9]+)?", string_regex,   "x*",
+      "[^\\x00-\\x7f]+", "if|[a-z_]+",  "(ab|a)(bc|c)?",      "[a-f0-9]{4}-", "a{2,3}b*",
+  };
+  const char *inputs[] = {
+      "", "abc", "aababb", "12.5e", "'a\\'b' rest", "xxa", "\xc3\xa9t\xc3\xa9", "ifx y_z", "abcab", "00ff-beef-", "aaab",
+  };
+
+  int status = 0;
+  for (int i = 0; i < LENGTH(patterns); i++) {
+    regex_cache_clear();
+    regex *r = mk_regex(patterns[i]);
+    regex_match matched[LENGTH(inputs)], found[LENGTH(inputs)];
+    for (int j = 0; j < LENGTH(inputs); j++) {
+      match_context ctx = mk_ctx(inputs[j]);
+      matched[j] = regex_matches(r, &ctx);
+      found[j] = regex_find(r, inputs[j]);
+    }
+    if (!regex_jit(r)) {
+      destroy_regex(r);
+      continue;
+    }
+    for (int j = 0; j < LENGTH(inputs); j++) {
+      match_context ctx = mk_ctx(inputs[j]);
+      regex_match m = regex_matches(r, &ctx);
+      regex_match f = regex_find(r, inputs[j]);
+      if (m.match != matched[j].match || m.matched.n != matched[j].matched.n || ctx.c != m.matched.n) {
+        error("Compiled %s matched %d characters of %s, expected %d", patterns[i], m.match ? m.matched.n : -1,
+              inputs[j], matched[j].match ? matched[j].matched.n : -1);
+        status++;
+      }
+      if (f.match != found[j].match || f.matched.str != found[j].matched.str || f.matched.n != found[j].matched.n) {
+        error("Compiled %s found a different match in %s", patterns[i], inputs[j]);
+        status++;
+      }
+    }
+    destroy_regex(r);
+  }
+
+  // A budget needs the interpreter, which counts its steps
+  regex *r = mk_regex("[a-z]+");
+  regex_jit(r);
+  regex_scratch *w = mk_regex_scratch();
+  regex_scratch_budget(w, 2);
+  match_context ctx = mk_ctx("abcdef");
+  regex_match m = regex_matches_r(r, &ctx, w);
+  if (m.match || !m.aborted) {
+    error("Compiled match over its budget was not aborted");
+    status++;
+  }
+  destroy_regex_scratch(w);
+  destroy_regex(r);
+
+  assert2(log_severity() <= LL_INFO);
+  return status;
+}
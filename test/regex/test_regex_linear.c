@@ -0,0 +1,90 @@
+// link: regex.o arena.o collections.o logging.o
+#include <string.h>
+
+#include "../unittest.h"
+#include "logging.h"
+#include "macros.h"
+#include "regex.h"
+
+// Patterns which take exponential time with a backtracking matcher, or have too many dfa states to cache.
+typedef struct {
+  const char *pattern;
+  // The input is `prefix` repeated `repeat` times, followed by `suffix`
+  const char *prefix;
+  int repeat;
+  const char *suffix;
+  bool match;
+} testcase;
+
+static char *mk_input(testcase *t) {
+  int prefix = strlen(t->prefix);
+  int suffix = strlen(t->suffix);
+  char *input = ecalloc(prefix * t->repeat + suffix + 1, 1);
+  for (int i = 0; i < t->repeat; i++)
+    memcpy(input + i * prefix, t->prefix, prefix);
+  memcpy(input + prefix * t->repeat, t->suffix, suffix);
+  return input;
+}
+
+#define AB "(a|b)"
+#define AB4 AB AB AB AB
+#define AB16 AB4 AB4 AB4 AB4
+
+int main(void) {
+  testcase testcases[] = {
+      {"(a|a)*b",           "a",     5000, "",                   false},
+      {"(a|a)*b",           "a",     5000, "b",                  true },
+      {"(a*)*b",            "a",     5000, "",                   false},
+      {"(a|aa)*c",          "a",     5000, "b",                  false},
+      {"((a+)+)+b",         "a",     5000, "",                   false},
+      {"(a?){30}a{30}",     "a",     30,   "",                   true },
+      {"(a|a){2,500}b",     "a",     5000, "",                   false},
+  };
+
+  int status = 0;
+  for (int i = 0; i < LENGTH(testcases); i++) {
+    testcase *t = &testcases[i];
+    regex *r = mk_regex(t->pattern);
+    char *input = mk_input(t);
+    if (regex_matches_strict(r, input) != t->match) {
+      error("Match %s on %s * %d + %s, expected %s", t->pattern, t->prefix, t->repeat, t->suffix,
+            t->match ? "true" : "false");
+      status++;
+    }
+    destroy_regex(r);
+    free(input);
+  }
+
+  // Starting a match at every offset would scan the rest of the input each time
+  regex *find = mk_regex("a*b");
+  char *as = mk_input(&(testcase){.prefix = "a", .repeat = 100000, .suffix = "cb"});
+  regex_match m = regex_find(find, as);
+  if (!m.match || m.matched.str != as + 100001 || m.matched.n != 1) {
+    error("Find a*b after %d characters", 100001);
+    status++;
+  }
+  destroy_regex(find);
+  free(as);
+
+  // The dfa for this pattern needs a state for every combination of the last 19 characters.
+  // A pseudo random input visits enough of them to exhaust the cache.
+  regex *r = mk_regex(AB "*a" AB16 AB AB);
+  char input[20001] = {0};
+  unsigned seed = 1;
+  for (int i = 0; i < LENGTH(input) - 1; i++) {
+    seed = seed * 1103515245 + 12345;
+    input[i] = (seed >> 16) & 1 ? 'a' : 'b';
+  }
+  for (int n = LENGTH(input) - 1; n > LENGTH(input) - 10; n--) {
+    input[n] = 0;
+    bool expected = input[n - 19] == 'a';
+    if (regex_matches_strict(r, input) != expected) {
+      error("Match with %d characters, expected %s", n, expected ? "true" : "false");
+      status++;
+    }
+  }
+  destroy_regex(r);
+
+  assert2(log_severity() <= LL_INFO);
+  return status;
+}
@@ -0,0 +1,87 @@
+// link: regex.o arena.o collections.o logging.o
+#include <string.h>
+
+#include "../unittest.h"
+#include "logging.h"
+#include "macros.h"
+#include "regex.h"
+
+typedef struct {
+  const char *pattern;
+  // Whether the pattern is matched without the automaton
+  bool fast;
+} testcase;
+
+// Regexes that are a few literals or one byte of a class match like the automaton would
+int main(void) {
+  testcase testcases[] = {
+      {",",           true },
+      {"\\[",         true },
+      {"true|false",  true },
+      {"a|ab|abc",    true },
+      {"(ab|a)(c|)",  true },
+      {"[a-f0-9]",    true },
+      {".",           true },
+      {"",            true },
+      {"ab*",         false},
+      {"[ab]c",       false},
+      {"a|[0-9]+",    false},
+  };
+  const char *inputs[] = {"", ",", "[x", "true", "falsetrue", "abcd", "xabcab", "ac", "f9", "9f", "abbb", "xx[,"};
+
+  int status = 0;
+  for (int i = 0; i < LENGTH(testcases); i++) {
+    testcase *t = &testcases[i];
+    regex *r = mk_regex(t->pattern);
+    bool fast = r->single_byte || r->nliterals;
+    if (fast != t->fast) {
+      error("%s should %sbe matched without the automaton", t->pattern, t->fast ? "" : "not ");
+      status++;
+    }
+    bool single_byte = r->single_byte;
+    int nliterals = r->nliterals;
+    for (int j = 0; j < LENGTH(inputs); j++) {
+      regex_match m[2], f[2];
+      bool strict[2];
+      int end[2];
+      // The second time the fast path is turned off
+      for (int k = 0; k < 2; k++) {
+        match_context ctx = mk_ctx(inputs[j]);
+        m[k] = regex_matches(r, &ctx);
+        end[k] = ctx.c;
+        f[k] = regex_find(r, inputs[j]);
+        strict[k] = regex_matches_strict(r, inputs[j]);
+        r->single_byte = false;
+        r->nliterals = 0;
+      }
+      r->single_byte = single_byte;
+      r->nliterals = nliterals;
+      if (m[0].match != m[1].match || m[0].matched.n != m[1].matched.n || end[0] != end[1]) {
+        error("%s matched %d characters of %s, expected %d", t->pattern, m[0].match ? m[0].matched.n : -1, inputs[j],
+              m[1].match ? m[1].matched.n : -1);
+        status++;
+      }
+      if (f[0].match != f[1].match || f[0].matched.str != f[1].matched.str || f[0].matched.n != f[1].matched.n) {
+        error("%s found a different match in %s", t->pattern, inputs[j]);
+        status++;
+      }
+      if (strict[0] != strict[1]) {
+        error("%s %s match all of %s", t->pattern, strict[0] ? "should not" : "should", inputs[j]);
+        status++;
+      }
+    }
+    destroy_regex(r);
+  }
+
+  // Literals are found with memmem, and the leftmost one wins even if an earlier alternative occurs later
+  regex *r = mk_regex("Holmes|Watson");
+  regex_match m = regex_find(r, "Dr Watson and Sherlock Holmes");
+  if (!m.match || m.matched.n != 6 || strncmp(m.matched.str, "Watson", 6) != 0) {
+    error("%s should find %s", "Holmes|Watson", "Watson");
+    status++;
+  }
+  destroy_regex(r);
+
+  assert2(log_severity() <= LL_INFO);
+  return status;
+}
@@ -0,0 +1,89 @@
+// link: regex.o arena.o collections.o logging.o
+#include <string.h>
+
+#include "../unittest.h"
+#include "logging.h"
+#include "macros.h"
+#include "regex.h"
+
+typedef struct {
+  const char *pattern;
+  const char *input;
+  // The leftmost-longest match, or NULL
+  const char *found;
+} testcase;
+
+// Check the leftmost-longest match of r in s against every substring of s
+static int check_substrings(const char *pattern, const char *s) {
+  regex *r = mk_regex(pattern);
+  int n = strlen(s);
+  char sub[64];
+  int start = -1, length = -1;
+  for (int i = 0; i < n && start < 0; i++) {
+    for (int j = n; j >= i && start < 0; j--) {
+      memcpy(sub, s + i, j - i);
+      sub[j - i] = '\0';
+      if (regex_matches_strict(r, sub)) {
+        start = i;
+        length = j - i;
+      }
+    }
+  }
+  regex_match m = regex_find_longest(r, s);
+  destroy_regex(r);
+  if (m.match == (start >= 0) && (!m.match || (m.matched.str - s == start && m.matched.n == length)))
+    return 0;
+  error("%s in %s matched at %d with length %d, expected %d with length %d", pattern, s,
+        m.match ? (int)(m.matched.str - s) : -1, m.match ? (int)m.matched.n : -1, start, length);
+  return 1;
+}
+
+int main(void) {
+  testcase testcases[] = {
+      {"a|ab",          "ab",     "ab"   },
+      {"ab|bcde",       "xabcde", "ab"   },
+      {"abcd|c",        "xabcd",  "abcd" },
+      {"(a|ab)(c|bcd)", "abcd",   "abcd" },
+      {"a+?",           "baaa",   "aaa"  },
+      {"x*",            "abc",    NULL   },
+      {"[0-9]+",        "ab",     NULL   },
+      {"(a|b)*c",       "xxababc", "ababc"},
+  };
+
+  int status = 0;
+  for (int i = 0; i < LENGTH(testcases); i++) {
+    testcase *t = &testcases[i];
+    regex *r = mk_regex(t->pattern);
+    regex_match m = regex_find_longest(r, t->input);
+    // An empty match counts as none
+    const char *expected = t->found ? strstr(t->input, t->found) : NULL;
+    if (t->found && (!m.match || m.matched.str != expected || m.matched.n != (int)strlen(t->found))) {
+      error("%s in %s should find %s", t->pattern, t->input, t->found);
+      status++;
+    } else if (!t->found && m.match && m.matched.n) {
+      error("%s in %s should find nothing", t->pattern, t->input);
+      status++;
+    }
+    destroy_regex(r);
+  }
+
+  // Anchored matches take the longest alternative and move past it
+  regex *r = mk_regex("a|ab|abc?d");
+  match_context ctx = mk_ctx("abcdx");
+  regex_match m = regex_longest(r, &ctx);
+  if (!m.match || m.matched.n != 4 || ctx.c != 4) {
+    error("%s should match %s at the beginning of %s", "a|ab|abc?d", "abcd", "abcdx");
+    status++;
+  }
+  destroy_regex(r);
+
+  const char *patterns[] = {"a|ab|b", "(ab|a)(bc|c)?", "b*|ab", "(a|b)*b(a|b)", "ba?|ab+"};
+  const char *inputs[] = {"xaab", "abcab", "bbabb", "aabab", "cabbba"};
+  for (int i = 0; i < LENGTH(patterns); i++) {
+    for (int j = 0; j < LENGTH(inputs); j++)
+      status += check_substrings(patterns[i], inputs[j]);
+  }
+
+  assert2(log_severity() <= LL_INFO);
+  return status;
+}
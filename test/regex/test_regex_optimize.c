@@ -0,0 +1,61 @@
+// link: regex.o arena.o collections.o logging.o
+#include "../unittest.h"
+#include "logging.h"
+#include "macros.h"
+#include "regex.h"
+
+typedef struct {
+  const char *pattern;
+  // Upper bound on the number of states after optimizing
+  int max_states;
+  const char *matching[4];
+  const char *failing[4];
+} testcase;
+
+int main(void) {
+  testcase testcases[] = {
+      {"a|b|c|d",                 3, {"a", "b", "d"},         {"", "e", "ab"}        },
+      {"(0|1|2|3|4|5|6|7|8|9)+",  6, {"0", "42", "9876"},     {"", "x", "1x"}        },
+      {"(a|b)*c",                 6, {"c", "abc", "bbac"},    {"", "ab", "abcc"}     },
+      {"a|b|[c-e]",               3, {"a", "c", "e"},         {"f", "ab"}            },
+      {"x?y?z?",                  6, {"", "xz", "xyz"},       {"zy", "xx"}           },
+      {"[a-c]|[d-f]|x",           5, {"a", "e", "x"},         {"g", "w"}             },
+  };
+
+  int status = 0;
+  for (int i = 0; i < LENGTH(testcases); i++) {
+    testcase *t = &testcases[i];
+    regex *r = mk_regex(t->pattern);
+    if (r->nstates > t->max_states) {
+      error("%s has %d states, expected at most %d", t->pattern, r->nstates, t->max_states);
+      status++;
+    }
+    for (int j = 0; j < LENGTH(t->matching) && t->matching[j]; j++) {
+      if (!regex_matches_strict(r, t->matching[j])) {
+        error("%s should match %s", t->pattern, t->matching[j]);
+        status++;
+      }
+    }
+    for (int j = 0; j < LENGTH(t->failing) && t->failing[j]; j++) {
+      if (regex_matches_strict(r, t->failing[j])) {
+        error("%s should not match %s", t->pattern, t->failing[j]);
+        status++;
+      }
+    }
+    destroy_regex(r);
+  }
+
+  // Groups still capture after their states are merged with others
+  regex *r = mk_regex("(a|b)(a|b)");
+  match_context ctx = mk_ctx("ba");
+  string_slice groups[3];
+  regex_match m = regex_captures(r, &ctx, groups);
+  if (!m.match || groups[1].str[0] != 'b' || groups[2].str[0] != 'a') {
+    error("Groups of %s on %s", "(a|b)(a|b)", "ba");
+    status++;
+  }
+  destroy_regex(r);
+
+  assert2(log_severity() <= LL_INFO);
+  return status;
+}
@@ -0,0 +1,80 @@
+// link: regex.o arena.o collections.o logging.o
+#include <string.h>
+
+#include "../unittest.h"
+#include "logging.h"
+#include "macros.h"
+#include "regex.h"
+
+// Long enough for several chunks, which matches cross the ends of
+#define LEN ((3 << 20) + 12345)
+
+typedef struct {
+  vec matches;
+  // Matches after which to stop, or 0
+  long max;
+} collected;
+
+static bool collect(regex_match m, void *data) {
+  collected *c = data;
+  vec_push(&c->matches, &m);
+  return c->max == 0 || c->matches.n < c->max;
+}
+
+// The parallel search finds the matches the iterator finds
+static int check(const char *pattern, string_slice input, int nthreads, long max) {
+  regex *r = mk_regex(pattern);
+  collected c = {.matches = v_make(regex_match), .max = max};
+  long count = regex_find_parallel(r, input, nthreads, 0, collect, &c);
+  regex_iter it = mk_regex_iter(r, input);
+  int failures = count != c.matches.n;
+  long i = 0;
+  for (regex_match m; !failures && (max == 0 || i < max) && (m = regex_iter_next(&it)).match; i++) {
+    regex_match *found = i < c.matches.n ? vec_nth(c.matches, i) : NULL;
+    failures += !found || found->matched.str != m.matched.str || found->matched.n != m.matched.n;
+  }
+  failures += i != c.matches.n;
+  if (failures)
+    error("%s with %d threads found %d matches, differing from the iterator", pattern, nthreads, (int)count);
+  vec_destroy(&c.matches);
+  destroy_regex(r);
+  return failures;
+}
+
+int main(void) {
+  // Short words, and quoted strings of which some cross the ends of chunks, and one runs over a whole chunk
+  char *input = ecalloc(LEN, 1);
+  unsigned seed = 1;
+  for (long i = 0; i < LEN; i++) {
+    seed = seed * 1103515245 + 12345;
+    input[i] = (seed >> 16) % 7 == 0 ? ' ' : 'a' + (seed >> 16) % 5;
+  }
+  long quotes[] = {1000, 5000, (1 << 20) - 10, (1 << 20) + 10, (2 << 20) - 200000, (3 << 20) + 5};
+  for (int i = 0; i < LENGTH(quotes); i++)
+    input[quotes[i]] = '"';
+  string_slice s = {.n = LEN, .str = input};
+
+  int status = 0;
+  const char *patterns[] = {"\"[^\"]*\"", "[a-e]+", "ab|abcd|cd", "x*", "(a|b)*c"};
+  for (int i = 0; i < LENGTH(patterns); i++)
+    status += check(patterns[i], s, 4, 0);
+  status += check("\"[^\"]*\"", s, 1, 0);
+  // The iteration stops once the callback wants no more matches
+  status += check("[a-e]+", s, 4, 10);
+
+  // A search given up because of the budget ends the iteration
+  regex *r = mk_regex("[a-e]+ ");
+  collected c = {.matches = v_make(regex_match)};
+  long count = regex_find_parallel(r, s, 4, 2, collect, &c);
+  regex_match *last = c.matches.n ? vec_nth(c.matches, c.matches.n - 1) : NULL;
+  if (count != c.matches.n - 1 || !last || !last->aborted) {
+    error("%s with a budget of %d should end with a match that was given up", "[a-e]+ ", 2);
+    status++;
+  }
+  vec_destroy(&c.matches);
+  destroy_regex(r);
+
+  free(input);
+  assert2(log_severity() <= LL_INFO);
+  return status;
+}
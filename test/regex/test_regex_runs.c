@@ -0,0 +1,52 @@
+// link: regex.o arena.o collections.o logging.o
+#include <string.h>
+
+#include "../unittest.h"
+#include "logging.h"
+#include "macros.h"
+#include "regex.h"
+
+#define MAX_RUN 80
+
+// Runs of bytes a dfa state loops on are skipped in strides, which must stop exactly where the run ends
+int main(void) {
+  const char *patterns[] = {"\"[^\"\\\\]*\"", "\"[a-zA-Z_]*\"", "\"[ \\n\\t]*\"", "\"(x|y|z)*\""};
+  const char *fill[] = {"a\x7f\xfe", "aZ_q", " \t\n", "xyz"};
+
+  int status = 0;
+  char input[MAX_RUN + 3];
+  for (int i = 0; i < LENGTH(patterns); i++) {
+    regex *r = mk_regex(patterns[i]);
+    int nfill = strlen(fill[i]);
+    for (int n = 1; n <= MAX_RUN; n++) {
+      input[0] = '"';
+      for (int j = 1; j < n; j++)
+        input[j] = fill[i][j % nfill];
+      input[n] = '"';
+      input[n + 1] = 'x';
+      input[n + 2] = '\0';
+      match_context ctx = mk_ctx(input);
+      regex_match m = regex_matches(r, &ctx);
+      if (!m.match || m.matched.n != n + 1) {
+        error("%s should match %d characters of %s", patterns[i], n + 1, input);
+        status++;
+      }
+      // A byte outside the run stops it, wherever it falls
+      input[n] = '#';
+      ctx = mk_ctx(input);
+      if (regex_matches(r, &ctx).match) {
+        error("%s should not match %s", patterns[i], input);
+        status++;
+      }
+      regex_match found = regex_find(r, input);
+      if (found.match) {
+        error("%s should not be found in %s", patterns[i], input);
+        status++;
+      }
+    }
+    destroy_regex(r);
+  }
+
+  assert2(log_severity() <= LL_INFO);
+  return status;
+}
@@ -0,0 +1,102 @@
+// link: regex.o arena.o collections.o logging.o
+#include <string.h>
+
+#include "../unittest.h"
+#include "logging.h"
+#include "macros.h"
+#include "regex.h"
+#include "text.h"
+
+#define AB "(a|b)"
+#define AB4 AB AB AB AB
+#define AB16 AB4 AB4 AB4 AB4
+
+// Compare every pattern of the set to matching it on its own
+static int check(regex_set *set, regex **regexes, const char **patterns, int n, const char *input) {
+  int status = 0;
+  long *ends = ecalloc(n, sizeof(long));
+  match_context ctx = mk_ctx(input);
+  int count = regex_set_matches(set, &ctx, ends);
+  if (ctx.c != 0) {
+    error("Set moved the cursor on %s", input);
+    status++;
+  }
+  int expected_count = 0;
+  for (int i = 0; i < n; i++) {
+    long expected = -1;
+    if (regexes[i]) {
+      match_context c = mk_ctx(input);
+      regex_match m = regex_matches(regexes[i], &c);
+      expected = m.match ? m.matched.n : -1;
+    }
+    expected_count += expected >= 0;
+    if (ends[i] != expected) {
+      error("Set matched %s on %s with %d characters, expected %d", patterns[i] ? patterns[i] : "NULL", input,
+            (int)ends[i], (int)expected);
+      status++;
+    }
+  }
+  if (count != expected_count) {
+    error("Set matched %d patterns on %s, expected %d", count, input, expected_count);
+    status++;
+  }
+  free(ends);
+  return status;
+}
+
+int main(void) {
+  const char *patterns[] = {
+      "true|false", string_regex, "-?(\\d+|\\d+\\.\\d*|\\d*\\.\\d+)", NULL, "[a-zA-Z_][a-zA-Z_0-9]*",
+      "a*?b|a+",    "(a|ab)(c|bcd)", "",  "x*",
+  };
+  const char *inputs[] = {
+      "", "'str'", "\"a\\\"b\" rest", "-12.5e", ".5", "truefalse", "falsy", "ident_1 x", "aaab", "aaa", "abcd", "acd",
+  };
+
+  int status = 0;
+  int n = LENGTH(patterns);
+  regex *regexes[LENGTH(patterns)] = {0};
+  for (int i = 0; i < n; i++)
+    regexes[i] = patterns[i] ? mk_regex(patterns[i]) : NULL;
+  regex_set *set = mk_regex_set(patterns, n);
+  for (int j = 0; j < LENGTH(inputs); j++)
+    status += check(set, regexes, patterns, n, inputs[j]);
+  destroy_regex_set(set);
+
+  // A set of one pattern still reports it by index
+  for (int i = 0; i < n; i++) {
+    regex_set *single = mk_regex_set(&patterns[i], 1);
+    for (int j = 0; j < LENGTH(inputs); j++)
+      status += check(single, &regexes[i], &patterns[i], 1, inputs[j]);
+    destroy_regex_set(single);
+  }
+
+  // Too many states to cache, so the set falls back to simulating the automaton
+  const char *big[] = {AB "*a" AB16 AB AB, "(a|b)*", "b+"};
+  regex *big_regexes[LENGTH(big)];
+  for (int i = 0; i < LENGTH(big); i++)
+    big_regexes[i] = mk_regex(big[i]);
+  char input[20001] = {0};
+  unsigned seed = 1;
+  for (int i = 0; i < LENGTH(input) - 1; i++) {
+    seed = seed * 1103515245 + 12345;
+    input[i] = (seed >> 16) & 1 ? 'a' : 'b';
+  }
+  set = mk_regex_set(big, LENGTH(big));
+  status += check(set, big_regexes, big, LENGTH(big), input);
+  destroy_regex_set(set);
+  for (int i = 0; i < LENGTH(big); i++)
+    destroy_regex(big_regexes[i]);
+
+  for (int i = 0; i < n; i++)
+    destroy_regex(regexes[i]);
+  assert2(log_severity() <= LL_INFO);
+
+  set_loglevel(LL_FATAL);
+  const char *invalid[] = {"a", "h+*"};
+  if (mk_regex_set(invalid, LENGTH(invalid)) != NULL) {
+    error("Set with an invalid pattern should have been rejected");
+    status++;
+  }
+  return status;
+}
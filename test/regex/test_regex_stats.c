@@ -0,0 +1,118 @@
+// link: regex.o arena.o collections.o logging.o
+#include <string.h>
+
+#include "../unittest.h"
+#include "logging.h"
+#include "macros.h"
+#include "regex.h"
+
+#define AB "(a|b)"
+#define AB4 AB AB AB AB
+#define AB16 AB4 AB4 AB4 AB4
+#define LEN 10000
+#define AB_LEN 100000
+
+int main(void) {
+  int status = 0;
+  char *input = ecalloc(LEN + 1, 1);
+  memset(input, 'a', LEN);
+  regex_scratch *w = mk_regex_scratch();
+  const regex_stats *stats = regex_scratch_stats(w);
+
+  // A run of a class is consumed by the dfa, which skips most of it
+  regex *r = mk_regex("[a-z]+");
+  match_context ctx = mk_ctx(input);
+  regex_match m = regex_matches_r(r, &ctx, w);
+  if (!m.match || m.matched.n != LEN || stats->dfa_bytes != LEN || stats->run_bytes < LEN / 2 ||
+      stats->nfa_bytes != 0 || stats->aborted) {
+    error("Stats of %s: %d dfa bytes, %d in runs, %d nfa bytes", "[a-z]+", (int)stats->dfa_bytes,
+          (int)stats->run_bytes, (int)stats->nfa_bytes);
+    status++;
+  }
+
+  // A search finds where the match starts with the reversed dfa, without simulating the nfa
+  m = regex_find_r(r, input, w);
+  if (!m.match || m.matched.str != input || m.matched.n != LEN || stats->nfa_bytes != 0) {
+    error("Search of %s simulated the nfa over %d bytes", "[a-z]+", (int)stats->nfa_bytes);
+    status++;
+  }
+
+  // The same match gives up once it exceeds its budget, and counts again from zero for the next match
+  regex_scratch_budget(w, 100);
+  ctx = mk_ctx(input);
+  m = regex_matches_r(r, &ctx, w);
+  if (m.match || !m.aborted || ctx.c != 0 || stats->dfa_bytes > 100 || stats->aborted != 1) {
+    error("Match of %s over its budget was not aborted", "[a-z]+");
+    status++;
+  }
+  m = regex_find_r(r, "xyz", w);
+  if (!m.match || m.aborted || stats->aborted) {
+    error("Match of %s within its budget", "[a-z]+");
+    status++;
+  }
+  regex_scratch_budget(w, 0);
+  destroy_regex(r);
+
+  // Too many states to cache, so the nfa is simulated and bounded as well
+  char *ab = ecalloc(AB_LEN + 1, 1);
+  unsigned seed = 1;
+  for (int i = 0; i < AB_LEN; i++) {
+    seed = seed * 1103515245 + 12345;
+    ab[i] = (seed >> 16) & 1 ? 'a' : 'b';
+  }
+  r = mk_regex(AB "*a" AB16 AB AB);
+  regex_find_r(r, ab, w);
+  regex_scratch_budget(w, LEN);
+  m = regex_find_r(r, ab, w);
+  if (m.match || !m.aborted || stats->dfa_failures != 1 || stats->nfa_states == 0) {
+    error("Simulated match over its budget: %d nfa states", (int)stats->nfa_states);
+    status++;
+  }
+  string_slice groups[20];
+  ctx = mk_ctx(ab);
+  m = regex_captures_r(r, &ctx, groups, w);
+  if (m.match || !m.aborted) {
+    error("Captures over their budget were not aborted");
+    status++;
+  }
+  regex_scratch_budget(w, 0);
+  destroy_regex(r);
+  free(ab);
+
+  // Sets report an aborted match instead of a count
+  const char *patterns[] = {"a+", "a*b"};
+  regex_set *set = mk_regex_set(patterns, LENGTH(patterns));
+  long ends[LENGTH(patterns)];
+  regex_scratch_budget(w, 10);
+  ctx = mk_ctx(input);
+  if (regex_set_matches_r(set, &ctx, ends, w) != -1 || ends[0] != -1) {
+    error("Set match over its budget was not aborted");
+    status++;
+  }
+  regex_scratch_budget(w, 0);
+  destroy_regex_set(set);
+
+  // Totals add up the matches of every caller
+  r = mk_regex("a+b?");
+  regex_count_stats(r);
+  long bytes = 0;
+  for (int i = 0; i < 3; i++) {
+    ctx = mk_ctx(input);
+    regex_matches_r(r, &ctx, w);
+    bytes += stats->dfa_bytes;
+  }
+  ctx = mk_ctx(input);
+  regex_matches(r, &ctx);
+  bytes += regex_scratch_stats(regex_thread_scratch())->dfa_bytes;
+  regex_stats totals = regex_total_stats(r);
+  if (totals.dfa_bytes != bytes || totals.dfa_bytes != 4 * LEN) {
+    error("Totals of %s count %d dfa bytes, expected %d", "a+b?", (int)totals.dfa_bytes, (int)bytes);
+    status++;
+  }
+  destroy_regex(r);
+
+  destroy_regex_scratch(w);
+  free(input);
+  assert2(log_severity() <= LL_INFO);
+  return status;
+}
@@ -0,0 +1,107 @@
+// link: regex.o arena.o collections.o logging.o
+#include <string.h>
+
+#include "../unittest.h"
+#include "logging.h"
+#include "macros.h"
+#include "regex.h"
+
+#define MAX_MATCHES 64
+
+typedef struct {
+  int n;
+  regex_stream_match matches[MAX_MATCHES];
+} matches_t;
+
+// Find all matches by calling regex_find again after every match
+static void find_all(regex *r, const char *input, matches_t *out) {
+  out->n = 0;
+  long from = 0;
+  long n = strlen(input);
+  while (from < n && out->n < MAX_MATCHES) {
+    regex_match m = regex_find(r, input + from);
+    if (!m.match)
+      break;
+    long start = m.matched.str - input;
+    long end = start + m.matched.n;
+    out->matches[out->n++] = (regex_stream_match){.match = true, .start = start, .end = end};
+    from = end > start ? end : end + 1;
+  }
+}
+
+// Find all matches by streaming the input in chunks of the given size
+static void stream_all(regex_stream *s, const char *input, long chunk, matches_t *out) {
+  out->n = 0;
+  long n = strlen(input);
+  regex_stream_match m;
+  for (long i = 0; i < n; i += chunk) {
+    long size = i + chunk < n ? chunk : n - i;
+    for (long used = 0; used < size;) {
+      used += regex_stream_feed(s, input + i + used, size - used, &m);
+      if (m.match && out->n < MAX_MATCHES)
+        out->matches[out->n++] = m;
+    }
+  }
+  while (regex_stream_end(s, &m)) {
+    if (out->n < MAX_MATCHES)
+      out->matches[out->n++] = m;
+  }
+}
+
+int main(void) {
+  const char *patterns[] = {
+      "a+b", "x*", "(a|ab)(c|bcd)", "a*?b|a+", string_regex, "\\d+(\\.\\d+)?", "abc|bcd|cde", "",
+  };
+  const char *inputs[] = {
+      "", "aab", "xaab aaab ab b", "abcd abc acd", "aaaa", "'a\\'b' \"cd\" 'unterminated", "12.5 3. 4.25x", "abcdef",
+  };
+  long chunks[] = {1, 2, 3, 7, 1000};
+
+  int status = 0;
+  for (int i = 0; i < LENGTH(patterns); i++) {
+    regex *r = mk_regex(patterns[i]);
+    regex_stream *s = mk_regex_stream(r);
+    for (int j = 0; j < LENGTH(inputs); j++) {
+      matches_t expected, actual;
+      find_all(r, inputs[j], &expected);
+      for (int k = 0; k < LENGTH(chunks); k++) {
+        stream_all(s, inputs[j], chunks[k], &actual);
+        bool same = actual.n == expected.n;
+        for (int m = 0; same && m < actual.n; m++)
+          same = actual.matches[m].start == expected.matches[m].start && actual.matches[m].end == expected.matches[m].end;
+        if (!same) {
+          error("Streaming %s over %s in chunks of %d found %d matches, expected %d", patterns[i], inputs[j],
+                (int)chunks[k], actual.n, expected.n);
+          status++;
+        }
+      }
+    }
+    destroy_regex_stream(s);
+    destroy_regex(r);
+  }
+
+  // A partial match tells how much input has to be kept
+  regex *r = mk_regex("a+b");
+  regex_stream *s = mk_regex_stream(r);
+  regex_stream_match m;
+  regex_stream_feed(s, "xxaa", 4, &m);
+  if (m.match || !regex_stream_pending(s) || regex_stream_keep(s) != 2) {
+    error("Partial match of %s should start at %d", "a+b", 2);
+    status++;
+  }
+  long used = regex_stream_feed(s, "abx", 3, &m);
+  if (!m.match || m.start != 2 || m.end != 6 || used != 2) {
+    error("Match of %s across chunks at %d-%d after %d bytes", "a+b", (int)m.start, (int)m.end, (int)used);
+    status++;
+  }
+  regex_stream_feed(s, "x", 1, &m);
+  if (regex_stream_pending(s) || regex_stream_keep(s) != 7) {
+    error("No match of %s should be pending", "a+b");
+    status++;
+  }
+  destroy_regex_stream(s);
+  destroy_regex(r);
+
+  assert2(log_severity() <= LL_INFO);
+  return status;
+}
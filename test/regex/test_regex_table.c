@@ -0,0 +1,67 @@
+// link: regex.o arena.o collections.o logging.o
+#include <string.h>
+
+#include "../unittest.h"
+#include "logging.h"
+#include "macros.h"
+#include "regex.h"
+#include "text.h"
+
+// Match like the code generated by regex2c
+static long table_match(const regex_table *t, const char *s, long n) {
+  int st = 0;
+  long last = t->match[0] ? 0 : -1;
+  for (long i = 0; i < n && !t->done[st]; i++) {
+    st = t->next[st * t->classes.n + t->classes.map[(u8)s[i]]];
+    if (t->match[st])
+      last = i + 1;
+  }
+  return last;
+}
+
+int main(void) {
+  const char *patterns[] = {
+      string_regex, "-?(\\d+|\\d+\\.\\d*|\\d*\\.\\d+)", "true|false", "[a-zA-Z_][a-zA-Z_0-9]*", "a*?b|a+", "(a|ab)(c|bcd)", "",
+  };
+  const char *inputs[] = {
+      "", "'str'", "\"a\\\"b\" rest", "-12.5e", ".5", "truefalse", "falsy", "ident_1 x", "aaab", "aaa", "abcd", "acd",
+  };
+
+  int status = 0;
+  for (int i = 0; i < LENGTH(patterns); i++) {
+    regex *r = mk_regex(patterns[i]);
+    regex_table *t = mk_regex_table(r, 1000);
+    if (t == NULL) {
+      error("No table for %s", patterns[i]);
+      status++;
+      destroy_regex(r);
+      continue;
+    }
+    for (int j = 0; j < LENGTH(inputs); j++) {
+      match_context ctx = mk_ctx(inputs[j]);
+      regex_match m = regex_matches(r, &ctx);
+      long expected = m.match ? m.matched.n : -1;
+      long actual = table_match(t, inputs[j], strlen(inputs[j]));
+      if (expected != actual) {
+        error("Table for %s on %s matched %d characters, expected %d", patterns[i], inputs[j], (int)actual,
+              (int)expected);
+        status++;
+      }
+    }
+    destroy_regex_table(t);
+    destroy_regex(r);
+  }
+
+  // Needs a state for every combination of the last 8 characters
+  regex *r = mk_regex("(a|b)*a(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)");
+  regex_table *t = mk_regex_table(r, 100);
+  if (t != NULL) {
+    error("Table with %d states should have been rejected", t->nstates);
+    status++;
+  }
+  destroy_regex_table(t);
+  destroy_regex(r);
+
+  assert2(log_severity() <= LL_INFO);
+  return status;
+}
@@ -0,0 +1,71 @@
+// link: regex.o arena.o collections.o logging.o
+#include <pthread.h>
+
+#include "../unittest.h"
+#include "logging.h"
+#include "macros.h"
+#include "regex.h"
+#include "text.h"
+
+#define THREADS 4
+#define ROUNDS 200
+
+typedef struct {
+  const char *pattern;
+  const char *string;
+  int length;
+  regex *r;
+} testcase;
+
+static testcase testcases[] = {
+    {.pattern = "[0-9]+",                 .string = "123.456",                .length = 3 },
+    {.pattern = "[0-9]+?",                .string = "123.456",                .length = 1 },
+    {.pattern = ".*?ab",                  .string = "123123abab",             .length = 8 },
+    {.pattern = ".*ab",                   .string = "123123abab",             .length = 10},
+    {.pattern = "(a|b)*c",                .string = "babbac",                 .length = 6 },
+    {.pattern = "(a|b)*c",                .string = "babbab",                 .length = -1},
+    {.pattern = string_regex,             .string = "\"str \\\"escaped!\" rest", .length = 16},
+    {.pattern = "[a-zA-Z_][a-zA-Z_0-9]*", .string = "identifier_1 rest",      .length = 12},
+};
+
+static void *worker(void *arg) {
+  long id = (long)arg;
+  // Half of the threads use their own scratch, the other half use the thread local default
+  regex_scratch *scratch = id % 2 ? mk_regex_scratch() : NULL;
+  long failures = 0;
+  for (int round = 0; round < ROUNDS; round++) {
+    for (int i = 0; i < LENGTH(testcases); i++) {
+      testcase *t = &testcases[(i + id) % LENGTH(testcases)];
+      match_context ctx = mk_ctx(t->string);
+      regex_match m = scratch ? regex_matches_r(t->r, &ctx, scratch) : regex_matches(t->r, &ctx);
+      int length = m.match ? m.matched.n : -1;
+      if (length != t->length)
+        failures++;
+    }
+  }
+  destroy_regex_scratch(scratch);
+  return (void *)failures;
+}
+
+int main(void) {
+  for (int i = 0; i < LENGTH(testcases); i++)
+    testcases[i].r = mk_regex(testcases[i].pattern);
+
+  pthread_t threads[THREADS];
+  for (long i = 0; i < THREADS; i++)
+    pthread_create(&threads[i], NULL, worker, (void *)i);
+
+  long failures = 0;
+  for (int i = 0; i < THREADS; i++) {
+    void *result;
+    pthread_join(threads[i], &result);
+    failures += (long)result;
+  }
+  if (failures)
+    error("%d matches gave the wrong result", (int)failures);
+
+  for (int i = 0; i < LENGTH(testcases); i++)
+    destroy_regex(testcases[i].r);
+  assert2(log_severity() <= LL_INFO);
+  return failures != 0;
+}
@@ -92,6 +92,22 @@ void test_regex_scanner(void) {
   }
   if (next_token(&s, valid, NULL) != EOF_TOKEN)
     die("Expected EOF");
+
+  // Bytes in the same class have to be indistinguishable to every token
+  byte_classes *c = &s.classes;
+  if (c->map['0'] != c->map['9'] || c->map['a'] == c->map['0'] || c->n > 64)
+    error("Unexpected byte classes, %d classes", c->n);
+  char first[UINT8_MAX + 1] = {0};
+  for (int b = 1; b <= UINT8_MAX; b++) {
+    if (first[c->map[b]] == 0)
+      first[c->map[b]] = b;
+    char str[] = {b, 0};
+    char rep[] = {first[c->map[b]], 0};
+    v_foreach(token, t, s.tokens) {
+      if (t->pattern && regex_matches_strict(t->pattern, str) != regex_matches_strict(t->pattern, rep))
+        error("Byte %d and %d are in the same class but %S tells them apart", b, rep[0], t->name);
+    }
+  }
   destroy_scanner(&s);
 }
 
@@ -44,6 +44,11 @@ int main(void) {
   for (int i = 0; i < initial_alloc; i++) {
     assert2(fst[i] == i % 128);
   }
+  // Allocations of odd sizes don't misalign the ones after them, in the same block or a new one
+  for (int i = 0; i < 100; i++) {
+    char *odd = arena_alloc(a, 1 + i * 37 % 301, 1);
+    assert2((size_t)odd % _Alignof(max_align_t) == 0);
+  }
   assert2(log_severity() <= LL_INFO);
   destroy_arena(a);
   return 0;